@@ -1,5 +1,7 @@
 #include "FlexibleCircularBuffer.h"
 
+#include <cstdio>
+
 
 /// @brief add data to last line. if char data type then remove \0 simbol
 /// @param id id of the last line of data, in order to make sure that the data will be written exactly in the required line, if a new line was created and you try to write in the old line, 0 will be returned
@@ -9,31 +11,41 @@
 template <>
 uint32_t FlexibleCircularBuffer<char>::WriteToLastLine(uint32_t id, const char *data, uint16_t length)
 {
-  if (_indexLastLine == -1 || id != lines[_indexLastLine].id ||
-      calculateLineLength(lines[_indexLastLine]) + length > _bufferSize / 2)
+  SyncGuard lock(*this);
+
+  if (_state->indexLastLine == -1 || id != lines[_state->indexLastLine].id || isGroupOfOtherWriter() ||
+      calculateLineLength(lines[_state->indexLastLine]) + length > _bufferSize / 2)
     return 0;
 
-  // if the data fits into the buffer without fragmentation, then we simply write it to the buffer
-  if ((lines[_indexLastLine].endIndex + length) < _bufferSize)
-  {
-    memcpy(buff + lines[_indexLastLine].endIndex, data, length * sizeof(char));
-    lines[_indexLastLine].endIndex = lines[_indexLastLine].endIndex + length - 1;
-  }
-  else
+  if (length > 0)
   {
-    // Otherwise, we need to split the line.
-    memcpy(buff + lines[_indexLastLine].endIndex, data,
-           (_bufferSize - lines[_indexLastLine].endIndex - 1) * sizeof(char));
-    lines[_indexLastLine].endIndex = _bufferSize - lines[_indexLastLine].endIndex - 2;
-    data += lines[_indexLastLine].endIndex;
-    length -= lines[_indexLastLine].endIndex + 1;
-
-    // Write the rest of the data to a new line.
-    memcpy(buff, data, length * sizeof(char));
-    lines[_indexLastLine].endIndex = length - 1;
-  }
+    // The appended data overwrites the \0 at the end of the line.
+    uint16_t startIndex = lines[_state->indexLastLine].endIndex;
+
+    BufferLineMarker grownLine = lines[_state->indexLastLine];
+    grownLine.endIndex = (lines[_state->indexLastLine].endIndex + length - 1) % _bufferSize;
 
-  FixIntersection(lines[_indexLastLine]);
+    if (!canOverwrite(grownLine, false))
+      return 0;
+
+    {
+      ChangeGuard change(*this);
+      FixIntersection(grownLine);
+      copyIn(startIndex, data, length);
+      lines[_state->indexLastLine].endIndex = grownLine.endIndex;
+    }
+    notifyWritten(_state->indexLastLine);
+    checkPressure();
+  }
 
   return id;
 }
+
+/// @brief Format the summary of the lines dropped by the rate limit.
+/// @return length of the summary with \0, 0 if it does not fit
+template <>
+uint16_t FlexibleCircularBuffer<char>::formatDropSummary(uint8_t sourceId, uint32_t count, char *to)
+{
+  int length = snprintf(to, DropSummaryLength, "dropped %lu lines of source %u", (unsigned long)count, sourceId);
+  return length < 0 || length >= DropSummaryLength ? 0 : length + 1;
+}
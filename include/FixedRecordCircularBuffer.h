@@ -0,0 +1,236 @@
+#pragma once
+
+#ifndef FixedRecordCircularBuffer_h
+#define FixedRecordCircularBuffer_h
+
+#include "FlexibleCircularBuffer.h"
+
+/// @brief Circular buffer of records of the same length, for example fixed telemetry structs.
+/// The records are kept in slots in order of ids, so the slot of a record is computed from its id, there are no line markers, a record never wraps around
+/// the end of the buffer and nothing has to be evicted: a write or a read is a single copy at a computed index.
+/// Only the time of the write is kept beside each record.
+/// @tparam BuffT Type of the buffer, must be trivially copyable.
+/// @tparam RecordLength count of elements in a record
+template <typename BuffT, uint16_t RecordLength>
+class FixedRecordCircularBuffer
+{
+  static_assert(std::is_trivially_copyable<BuffT>::value, "The records are copied with memcpy");
+  static_assert(RecordLength > 0, "A record has at least one element");
+
+public:
+  /// @brief Constructor.
+  /// @param capacity count of records in the buffer
+  /// @param resource memory resource for the records
+  FixedRecordCircularBuffer(uint16_t capacity = 128, std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : _capacity(capacity),
+        _resource(resource)
+  {
+    _records = static_cast<BuffT *>(_resource->allocate(sizeof(BuffT) * RecordLength * _capacity, alignof(BuffT)));
+    _timestamps = static_cast<uint64_t *>(_resource->allocate(sizeof(uint64_t) * _capacity, alignof(uint64_t)));
+    sync_init();
+  }
+
+  ~FixedRecordCircularBuffer()
+  {
+    _resource->deallocate(_records, sizeof(BuffT) * RecordLength * _capacity, alignof(BuffT));
+    _resource->deallocate(_timestamps, sizeof(uint64_t) * _capacity, alignof(uint64_t));
+#ifdef ThreadSafe
+#if ThreadSafe == FreeRTOS
+    vSemaphoreDelete(sync_mutex);
+#endif
+#endif
+  }
+
+  FixedRecordCircularBuffer(const FixedRecordCircularBuffer &) = delete;
+  FixedRecordCircularBuffer &operator=(const FixedRecordCircularBuffer &) = delete;
+
+  /// @brief Write new record to buffer, the oldest record is overwritten when the buffer is full.
+  /// @param data RecordLength elements
+  /// @return id of the record
+  uint32_t WriteLine(const BuffT *data)
+  {
+    return WriteLine(data, FlexibleCircularBufferClock::Now());
+  }
+
+  /// @brief Write new record to buffer with the given time, the oldest record is overwritten when the buffer is full.
+  /// @param data RecordLength elements
+  /// @param timestamp time of the record, in ticks of FlexibleCircularBufferClock
+  /// @return id of the record
+  uint32_t WriteLine(const BuffT *data, uint64_t timestamp)
+  {
+    sync_lock();
+    uint32_t id = _nextId++;
+    if (_count < _capacity)
+      _count++;
+    else
+      _firstSlot = _firstSlot + 1 == _capacity ? 0 : _firstSlot + 1;
+    uint16_t slot = slotOf(id);
+    memcpy(_records + (size_t)slot * RecordLength, data, sizeof(BuffT) * RecordLength);
+    _timestamps[slot] = timestamp;
+    sync_unlock();
+    return id;
+  }
+
+  /// @brief Copy the record with given id.
+  /// @param id id of the record
+  /// @param to destination, RecordLength elements
+  /// @return false if the record was not found
+  bool ReadLine(uint32_t id, BuffT *to)
+  {
+    sync_lock();
+    bool ret = contains(id);
+    if (ret)
+      memcpy(to, _records + (size_t)slotOf(id) * RecordLength, sizeof(BuffT) * RecordLength);
+    sync_unlock();
+    return ret;
+  }
+
+  /// @brief Pass the record with given id to the visitor without copying it.
+  /// The buffer is locked while the visitor runs, so the visitor must not write to this buffer.
+  /// @param id id of the record
+  /// @param visitor callable with (const BufferLineView<BuffT> &)
+  /// @return false if the record was not found
+  template <typename Visitor>
+  bool VisitLine(uint32_t id, Visitor &&visitor)
+  {
+    sync_lock();
+    bool ret = contains(id);
+    if (ret)
+      visitor(createLineView(id));
+    sync_unlock();
+    return ret;
+  }
+
+  /// @brief Pass the records to the visitor in order, starting from the record with given id
+  /// (or from the first record, if that record was already overwritten).
+  /// @param fromId id of the first record to visit
+  /// @param visitor callable with (const BufferLineView<BuffT> &), returns false to stop
+  /// @return count of visited records
+  template <typename Visitor>
+  uint16_t VisitLines(uint32_t fromId, Visitor &&visitor)
+  {
+    sync_lock();
+    uint16_t count = 0;
+    uint32_t firstId = _nextId - _count;
+    uint32_t id = (int32_t)(fromId - firstId) < 0 ? firstId : fromId;
+    for (; (int32_t)(id - _nextId) < 0; id++)
+    {
+      count++;
+      if (!visitor(createLineView(id)))
+        break;
+    }
+    sync_unlock();
+    return count;
+  }
+
+  /// @brief Get the ids of the first and the last records.
+  /// @return false if the buffer is empty
+  bool GetIdRange(uint32_t &firstId, uint32_t &lastId)
+  {
+    sync_lock();
+    bool ret = _count > 0;
+    if (ret)
+    {
+      firstId = _nextId - _count;
+      lastId = _nextId - 1;
+    }
+    sync_unlock();
+    return ret;
+  }
+
+  /// @brief Set the id of the next record of an empty buffer.
+  /// @param id id of the next record, not 0
+  /// @return false if the buffer is not empty
+  bool SetNextId(uint32_t id)
+  {
+    sync_lock();
+    bool ret = _count == 0 && id != 0;
+    if (ret)
+      _nextId = id;
+    sync_unlock();
+    return ret;
+  }
+
+private:
+  // The records
+  BuffT *_records;
+  // Time of each record
+  uint64_t *_timestamps;
+  // Count of records in the buffer
+  const uint16_t _capacity;
+  // Memory resource of the records
+  std::pmr::memory_resource *const _resource;
+  // Id of the next record, 0 is reserved for errors
+  uint32_t _nextId = 1;
+  // Count of written records, up to _capacity
+  uint16_t _count = 0;
+  // Slot of the first record
+  uint16_t _firstSlot = 0;
+
+  /// @brief Get the slot of a record in the buffer.
+  uint16_t slotOf(uint32_t id) const
+  {
+    return (_firstSlot + (id - (_nextId - _count))) % _capacity;
+  }
+
+  bool contains(uint32_t id) const
+  {
+    return _nextId - id - 1 < _count;
+  }
+
+  BufferLineView<BuffT> createLineView(uint32_t id) const
+  {
+    BufferLineView<BuffT> view;
+    uint16_t slot = slotOf(id);
+    view.id = id;
+    view.timestamp = _timestamps[slot];
+    view.first = _records + (size_t)slot * RecordLength;
+    view.firstLength = RecordLength;
+    return view;
+  }
+
+  // Thread sync mutex.
+#ifdef ThreadSafe
+#if ThreadSafe == FreeRTOS
+  SemaphoreHandle_t sync_mutex = nullptr;
+#elif ThreadSafe == StdMutex
+  std::mutex sync_mutex;
+#endif
+#endif
+
+  /// @brief Create the thread sync mutex
+  void sync_init()
+  {
+#ifdef ThreadSafe
+#if ThreadSafe == FreeRTOS
+    sync_mutex = xSemaphoreCreateMutex();
+#endif
+#endif
+  }
+
+  /// @brief Thread lock
+  void sync_lock()
+  {
+#ifdef ThreadSafe
+#if ThreadSafe == FreeRTOS
+    xSemaphoreTake(sync_mutex, portMAX_DELAY);
+#elif ThreadSafe == StdMutex
+    sync_mutex.lock();
+#endif
+#endif
+  }
+
+  /// @brief Thread unlock
+  void sync_unlock()
+  {
+#ifdef ThreadSafe
+#if ThreadSafe == FreeRTOS
+    xSemaphoreGive(sync_mutex);
+#elif ThreadSafe == StdMutex
+    sync_mutex.unlock();
+#endif
+#endif
+  }
+};
+
+#endif
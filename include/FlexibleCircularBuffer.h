@@ -3,10 +3,28 @@
 #ifndef FlexibleCircularBuffer_h
 #define FlexibleCircularBuffer_h
 
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
 #include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 #define FreeRTOS 1
+#define StdMutex 2
+
+// Thread sync: FreeRTOS on ESP-IDF, std::mutex on host. Define ThreadSafe as 0 to disable locking.
+#ifndef ThreadSafe
+#ifdef ESP_PLATFORM
 #define ThreadSafe FreeRTOS
+#else
+#define ThreadSafe StdMutex
+#endif
+#endif
 
 #ifdef ThreadSafe
 #if ThreadSafe == FreeRTOS
@@ -15,11 +33,36 @@
 #include <freertos/semphr.h>
 #include <freertos/task.h>
 
+#elif ThreadSafe == StdMutex
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #endif
 #endif
 
 // #define DebugMode_FlexibleCircularBuffer
 
+#ifdef ESP_PLATFORM
+#include "esp_timer.h"
+#else
+#include <chrono>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if __has_include(<unistd.h>)
+#include <cerrno>
+#include <unistd.h>
+#define FlexibleCircularBuffer_RawDump
+#endif
+
 #ifdef DebugMode_FlexibleCircularBuffer
 #include <iostream>
 #include <fstream>
@@ -27,6 +70,158 @@
 #include <filesystem>
 #endif
 
+/// @brief Monotonic time in microseconds.
+inline uint64_t FlexibleCircularBufferMicros()
+{
+#ifdef ESP_PLATFORM
+  return esp_timer_get_time();
+#else
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/// @brief Clock of the timestamps of the lines, its ticks are microseconds.
+struct FlexibleCircularBufferSystemClock
+{
+public:
+  /// @brief Get the current time in ticks.
+  static uint64_t Now()
+  {
+    return FlexibleCircularBufferMicros();
+  }
+
+  /// @brief Convert a duration in ticks to microseconds.
+  static uint64_t TicksToMicros(uint64_t ticks)
+  {
+    return ticks;
+  }
+
+  /// @brief Convert a duration in microseconds to ticks.
+  static uint64_t MicrosToTicks(uint64_t micros)
+  {
+    return micros;
+  }
+
+  /// @brief Convert a timestamp to the time of FlexibleCircularBufferMicros.
+  static uint64_t ToMicros(uint64_t timestamp)
+  {
+    return timestamp;
+  }
+};
+
+/// @brief Clock of the timestamps of the lines that reads the cycle counter of the CPU: the time stamp counter on x86
+/// (it must be invariant, as on all current CPUs) or the virtual counter on AArch64. A write then costs a few cycles
+/// instead of a system call, and the ticks are converted to microseconds by the readers (ToMicros).
+/// On x86 the frequency of the counter is measured against FlexibleCircularBufferMicros once, which takes 10 ms:
+/// by Calibrate, which the constructors of FlexibleCircularBuffer call, so it is not done by a write under the lock.
+/// On the other targets the system clock is used: the CCOUNT register of Xtensa is 32 bits wide and not shared by the cores.
+struct FlexibleCircularBufferCycleClock
+{
+public:
+  /// @brief Get the current time in ticks.
+  static uint64_t Now()
+  {
+#if (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return FlexibleCircularBufferMicros();
+#endif
+  }
+
+  /// @brief Measure the frequency of the counter, if it was not measured yet. Called by the constructors
+  /// of FlexibleCircularBuffer; call it at start-up if the clock is used before a buffer is created.
+  static void Calibrate()
+  {
+    calibration();
+  }
+
+  /// @brief Convert a duration in ticks to microseconds.
+  static uint64_t TicksToMicros(uint64_t ticks)
+  {
+    uint64_t frequency = calibration().frequency;
+    return ticks / frequency * 1000000 + ticks % frequency * 1000000 / frequency;
+  }
+
+  /// @brief Convert a duration in microseconds to ticks.
+  static uint64_t MicrosToTicks(uint64_t micros)
+  {
+    uint64_t frequency = calibration().frequency;
+    return micros / 1000000 * frequency + micros % 1000000 * frequency / 1000000;
+  }
+
+  /// @brief Convert a timestamp to the time of FlexibleCircularBufferMicros.
+  static uint64_t ToMicros(uint64_t timestamp)
+  {
+    const Calibration &origin = calibration();
+    return timestamp >= origin.ticks ? origin.micros + TicksToMicros(timestamp - origin.ticks)
+                                     : origin.micros - TicksToMicros(origin.ticks - timestamp);
+  }
+
+private:
+  /// The same moment on both clocks, and the ticks per second.
+  struct Calibration
+  {
+    uint64_t ticks;
+    uint64_t micros;
+    uint64_t frequency;
+  };
+
+  static const Calibration &calibration()
+  {
+    static const Calibration ret = []
+    {
+      Calibration calibration;
+#if (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))) || defined(__x86_64__) || defined(__i386__)
+      uint64_t startMicros = FlexibleCircularBufferMicros(), startTicks = Now();
+      while (FlexibleCircularBufferMicros() - startMicros < 10000)
+      {
+      }
+      calibration.micros = FlexibleCircularBufferMicros();
+      calibration.ticks = Now();
+      calibration.frequency = (calibration.ticks - startTicks) * 1000000 / (calibration.micros - startMicros);
+#elif defined(__aarch64__)
+      asm volatile("mrs %0, cntfrq_el0" : "=r"(calibration.frequency));
+      calibration.micros = FlexibleCircularBufferMicros();
+      calibration.ticks = Now();
+#else
+      calibration.frequency = 1000000;
+      calibration.micros = calibration.ticks = Now();
+#endif
+      return calibration;
+    }();
+    return ret;
+  }
+};
+
+// Clock of the timestamps: FlexibleCircularBufferSystemClock, FlexibleCircularBufferCycleClock
+// or a struct with the same static methods (Calibrate is optional).
+#ifndef FlexibleCircularBuffer_Clock
+#define FlexibleCircularBuffer_Clock FlexibleCircularBufferSystemClock
+#endif
+
+typedef FlexibleCircularBuffer_Clock FlexibleCircularBufferClock;
+
+// Maximum count of observers of a buffer, enough for one of each observer of the library and a few of the application.
+#ifndef FlexibleCircularBuffer_MaxObservers
+#define FlexibleCircularBuffer_MaxObservers 8
+#endif
+
+/// @brief Calibrate the clock, if it has a Calibrate method (see FlexibleCircularBufferCycleClock::Calibrate).
+template <typename Clock>
+auto FlexibleCircularBufferCalibrateClock(int) -> decltype(Clock::Calibrate())
+{
+  Clock::Calibrate();
+}
+
+template <typename Clock>
+void FlexibleCircularBufferCalibrateClock(long)
+{
+}
+
 template <typename BuffT>
 struct BufferLine
 {
@@ -49,25 +244,48 @@ public:
     return _id;
   }
 
+  /// Get the time of the write, in ticks of FlexibleCircularBufferClock (microseconds by default)
+  uint64_t GetTimestamp() const
+  {
+    return _timestamp;
+  }
+
+  /// Get the count of times the line was written again, see FlexibleCircularBuffer::SetDeduplicate
+  uint32_t GetRepeatCount() const
+  {
+    return _repeatCount;
+  }
+
   /// Destructor
   ~BufferLine()
   {
+    if constexpr (!std::is_trivially_destructible<BuffT>::value)
+    {
+      for (uint16_t i = 0; i < _length; i++)
+        _data[i].~BuffT();
+    }
     free(_data);
   }
 
 protected:
   /// Constructor
-  BufferLine(BuffT *data, uint16_t length, uint32_t id)
+  BufferLine(BuffT *data, uint16_t length, uint32_t id, uint64_t timestamp, uint32_t repeatCount)
       : _data(data),
+        _timestamp(timestamp),
         _id(id),
+        _repeatCount(repeatCount),
         _length(length)
   {
   }
 
   /// The data
   BuffT *_data;
+  /// The time of the write
+  const uint64_t _timestamp;
   /// The id
   const uint32_t _id;
+  /// The count of repeats
+  const uint32_t _repeatCount;
   /// The length data
   const uint16_t _length;
 };
@@ -82,9 +300,68 @@ public:
   /// @param data from buffer line.
   /// @param Length of the buffer line.
   /// @param id Identifier of the line.
-  EditableBufferLine(BuffT *data, uint16_t length, uint32_t id)
-      : BufferLine<BuffT>(data, length, id)
+  /// @param timestamp Time of the write, in ticks of FlexibleCircularBufferClock.
+  /// @param repeatCount Count of times the line was written again.
+  EditableBufferLine(BuffT *data, uint16_t length, uint32_t id, uint64_t timestamp = 0, uint32_t repeatCount = 0)
+      : BufferLine<BuffT>(data, length, id, timestamp, repeatCount)
+  {
+  }
+};
+
+/// @brief Line data inside the buffer, without copying it.
+/// A fragmented line is split into two parts: the end of the buffer and the beginning of the buffer.
+/// The view is valid only inside the visitor it was passed to.
+/// @tparam BuffT Type of the buffer.
+template <typename BuffT>
+struct BufferLineView
+{
+public:
+  /// Identifier of the line.
+  uint32_t id = 0;
+  /// Time of the write, in ticks of FlexibleCircularBufferClock (microseconds by default, see FlexibleCircularBufferClock::ToMicros).
+  uint64_t timestamp = 0;
+  /// Count of times the line was written again, see FlexibleCircularBuffer::SetDeduplicate.
+  uint32_t repeatCount = 0;
+  /// Key of the line, see LineWriteOptions::key.
+  uint16_t key = 0;
+  /// Lifetime of the line in milliseconds from its timestamp, 0 if the line does not expire, see LineWriteOptions::ttl.
+  uint32_t ttl = 0;
+  /// Set for a line passed to FlexibleCircularBufferObserver::OnLineEvicted that has expired or was superseded,
+  /// so the readers did not see it anymore.
+  bool stale = false;
+  /// Set for a pinned line, see LineWriteOptions::pin. The id of a pinned line is its position in the pinned region + 1.
+  bool pinned = false;
+  /// First part of the data.
+  const BuffT *first = nullptr;
+  /// Length of the first part.
+  uint16_t firstLength = 0;
+  /// Second part of the data, nullptr if the line is not fragmented.
+  const BuffT *second = nullptr;
+  /// Length of the second part.
+  uint16_t secondLength = 0;
+
+  /// Get the length
+  uint16_t GetLength() const
+  {
+    return firstLength + secondLength;
+  }
+
+  /// Get the element of the line by its position.
+  const BuffT &operator[](uint16_t index) const
+  {
+    return index < firstLength ? first[index] : second[index - firstLength];
+  }
+
+  /// @brief Copy a part of the line to the given array.
+  /// @param to destination, at least count elements
+  /// @param offset position in the line to copy from
+  /// @param count count of elements to copy
+  void CopyTo(BuffT *to, uint16_t offset, uint16_t count) const
   {
+    for (; count > 0 && offset < firstLength; count--)
+      *to++ = first[offset++];
+    for (offset -= firstLength; count > 0; count--)
+      *to++ = second[offset++];
   }
 };
 
@@ -97,129 +374,356 @@ public:
   int16_t endIndex = 0;
   /// Identifier of the line.
   uint32_t id = 0;
+  /// Time of the write, in ticks of FlexibleCircularBufferClock.
+  uint64_t timestamp = 0;
+  /// Count of times the same line was written again right after it, see FlexibleCircularBuffer::SetDeduplicate.
+  uint32_t repeatCount = 0;
+  /// Lifetime of the line in milliseconds from its timestamp, 0 if the line does not expire.
+  uint32_t ttl = 0;
+  /// Key of the line, 0 if none, see FlexibleCircularBuffer::SetCompaction.
+  uint16_t key = 0;
+  /// Flags of the line
+  uint8_t flags = 0;
+  /// Source of the line (LineWriteOptions::sourceId), a repeat of the line must come from the same source.
+  uint8_t sourceId = 0;
+
+  /// Flag of a line that belongs to the group of the previous line, see FlexibleCircularBuffer::BeginGroup.
+  static const uint8_t GroupContinued = 1;
+  /// Flag of a line replaced by a newer line with the same key, see FlexibleCircularBuffer::SetCompaction.
+  static const uint8_t Superseded = 2;
+
+  /// @brief Check if the line has expired at the given time.
+  bool isExpired(uint64_t now) const
+  {
+    return ttl != 0 && now - timestamp >= FlexibleCircularBufferClock::MicrosToTicks((uint64_t)ttl * 1000);
+  }
+
+  /// @brief Check if the line is skipped by the readers: it has expired or was superseded.
+  bool isStale(uint64_t now) const
+  {
+    return (flags & Superseded) != 0 || isExpired(now);
+  }
 
   /// @brief Check if the line intersects with the given line.
-  bool inIntersection(BufferLineMarker &line)
+  bool inIntersection(const BufferLineMarker &line) const
   {
+    // A line is fragmented when it wraps around the end of the buffer.
+    // A line of a single cell has startIndex == endIndex and is not fragmented.
+    bool fragmented = startIndex > endIndex;
+    bool lineFragmented = line.startIndex > line.endIndex;
+
     // Check if both lines are not fragmented.
-    if (startIndex < endIndex && line.startIndex < line.endIndex)
-    {
-      // If the start index is less than the line start index, the intersection
-      // is at the start of the line.
-      if (startIndex <= line.startIndex)
-        return endIndex >= line.startIndex;
-      // Otherwise, the intersection is at the end of the line.
-      return line.endIndex >= startIndex;
-    }
+    if (!fragmented && !lineFragmented)
+      return startIndex <= line.endIndex && line.startIndex <= endIndex;
     // if both lines are fragmented, then they exactly intersect.
-    if (startIndex > endIndex && line.startIndex > line.endIndex)
+    if (fragmented && lineFragmented)
       return true;
     // we check depending on which of the lines is fragmented
-    if (startIndex > endIndex)
+    if (fragmented)
       return line.startIndex <= endIndex || line.endIndex >= startIndex;
     return startIndex <= line.endIndex || endIndex >= line.startIndex;
   }
 };
 
-/// @brief circular buffer for data of different lengths
+/// @brief Receives the events of the buffer, see FlexibleCircularBuffer::AddObserver.
+/// The methods are called by the writer while the buffer is locked, so they must be short and must not access the buffer.
 /// @tparam BuffT Type of the buffer.
 template <typename BuffT>
-class FlexibleCircularBuffer
+class FlexibleCircularBufferObserver
 {
 public:
-  FlexibleCircularBuffer(uint16_t bufferSize = 4096, uint16_t maxLines = 128)
-      : _bufferSize(bufferSize),
-        _maxLines(maxLines)
+  virtual ~FlexibleCircularBufferObserver() = default;
+
+  /// @brief Called after a line was written, or data was added to the last line.
+  /// @param line the written line, BufferLineView::pinned is set for a line of the pinned region (FlexibleCircularBuffer::WritePinned)
+  virtual void OnLineWritten([[maybe_unused]] const BufferLineView<BuffT> &line)
   {
-#ifdef ThreadSafe
-#if ThreadSafe == FreeRTOS
-    sync_mutex = xSemaphoreCreateMutex();
-#endif
-#endif
+  }
 
-    buff = new BuffT[_bufferSize];
-    lines = new BufferLineMarker[_maxLines];
+  /// @brief Called after the data of a line was replaced by FlexibleCircularBuffer::UpdateLine,
+  /// or its repeat count was incremented (FlexibleCircularBuffer::SetDeduplicate).
+  /// @param line the updated line
+  virtual void OnLineUpdated([[maybe_unused]] const BufferLineView<BuffT> &line)
+  {
   }
 
-  ~FlexibleCircularBuffer()
+  /// @brief Called when the buffer crosses a watermark, see FlexibleCircularBuffer::SetWatermarks.
+  /// @param underPressure true when a high watermark was reached, false when the buffer is back under the low watermarks
+  virtual void OnPressureChanged([[maybe_unused]] bool underPressure)
   {
-    delete[] buff;
-    delete[] lines;
   }
 
-  /// @brief Write new line to buffer
-  /// @param data data
-  /// @param length data length
-  /// @return id of the created line. 0 if error
-  uint32_t WriteLine(const BuffT *data, uint16_t length)
+  /// @brief Called before a line is overwritten (or removed), while its data is still in the buffer.
+  /// The lines that have expired or were superseded are evicted too, with BufferLineView::stale set.
+  /// @param line the evicted line
+  virtual void OnLineEvicted([[maybe_unused]] const BufferLineView<BuffT> &line)
   {
-    // If the length of the data is 0, return 0.
-    if (length == 0)
-      return 0;
+  }
+};
 
-    // for the correct operation of the algorithm, there must always be at least two active lines in the buffer.
-    // therefore, we check that the new lines data does not occupy more than half of the buffer.
-    if (length > _bufferSize / 2)
-      return 0;
+/// @brief Optional settings of a written line.
+struct LineWriteOptions
+{
+public:
+  /// Time of the line in ticks of FlexibleCircularBufferClock, 0 for the current time.
+  /// Used to keep the original time when a line is moved from another buffer.
+  uint64_t timestamp = 0;
+  /// Count of repeats of the line, used when a line is moved from another buffer.
+  uint32_t repeatCount = 0;
+  /// Source of the line, for the rate limit of FlexibleCircularBuffer::SetRateLimit.
+  uint8_t sourceId = 0;
+  /// Lifetime of the line in milliseconds, 0 if the line does not expire.
+  /// An expired line is skipped by the readers and its space is reclaimed by the next write.
+  uint32_t ttl = 0;
+  /// Key of the line, 0 if none. When compaction is enabled (FlexibleCircularBuffer::SetCompaction),
+  /// the line supersedes the previous line with the same key.
+  uint16_t key = 0;
+};
 
-    sync_lock();
+/// @brief What the writer does when a new line would overwrite a line that a consumer has not committed yet.
+enum class ConsumerPolicy : uint8_t
+{
+  /// The write fails and returns 0.
+  Reject,
+  /// The write waits until the consumer commits the line. Only for consumers in other threads of the same process,
+  /// and not for a buffer attached to an external state (SharedFlexibleCircularBuffer): the caller holds its own lock
+  /// while the writer would wait, so no consumer could commit.
+  Block,
+  /// The line is overwritten, it is counted as lost by the consumer.
+  Evict
+};
 
-    // Get the next index to write to.
-    int16_t nextIndex = getNextIndex(_indexLastLine);
+/// @brief Occupancy limits of FlexibleCircularBuffer::SetWatermarks, 0 for a high watermark disables it.
+struct BufferWatermarks
+{
+public:
+  /// The buffer is under pressure when the pending lines take at least this count of elements.
+  uint16_t highCells = 0;
+  /// The pressure ends when the pending lines take at most this count of elements (and lowLines).
+  uint16_t lowCells = 0;
+  /// The buffer is under pressure when there are at least this count of pending lines.
+  uint16_t highLines = 0;
+  /// The pressure ends when there are at most this count of pending lines (and lowCells).
+  uint16_t lowLines = 0;
+};
 
-    // Create a new line.
-    BufferLineMarker newLine;
-    newLine.endIndex = 0;
+/// @brief Committed position of a named consumer, see FlexibleCircularBuffer::AddConsumer.
+struct BufferConsumer
+{
+public:
+  /// Maximum length of the name, with \0.
+  static const uint8_t MaxNameLength = 16;
+
+  /// Name of the consumer, empty if the slot is free.
+  char name[MaxNameLength] = {};
+  /// Id of the last line the consumer has processed, the newer lines are kept for it.
+  uint32_t committedId = 0;
+  /// Count of lines overwritten before the consumer committed them (ConsumerPolicy::Evict),
+  /// without the lines that had expired or were superseded.
+  uint32_t lost = 0;
+  /// What the writer does with the lines not committed yet.
+  ConsumerPolicy policy = ConsumerPolicy::Reject;
+};
 
-    // if the data fits into the buffer without fragmentation, then we simply write it to the buffer
-    if ((lines[_indexLastLine].endIndex + length + 1) < _bufferSize)
-    {
-      memcpy(_indexLastLine == -1 ? buff : (buff + lines[_indexLastLine].endIndex + 1), data, length * sizeof(BuffT));
-      newLine.endIndex = (_indexLastLine == -1 ? 0 : lines[_indexLastLine].endIndex + 1) + length - 1;
-    }
-    else
-    {
-      // Otherwise, we need to split the line.
-      memcpy(_indexLastLine == -1 ? buff : (buff + lines[_indexLastLine].endIndex + 1),
-             data,
-             (_bufferSize - lines[_indexLastLine].endIndex - 1) * sizeof(BuffT));
-      newLine.endIndex = _bufferSize - lines[_indexLastLine].endIndex - 1;
-      data += newLine.endIndex;
-      length -= newLine.endIndex;
+/// @brief Positions of the lines in the buffer.
+/// It is kept apart from the buffer object, so it can be placed in shared memory together with the data.
+struct BufferRingState
+{
+public:
+  /// Index of the first line
+  int16_t indexFirstLine = -1;
+  /// Index of the last line
+  int16_t indexLastLine = -1;
+  /// Identifier of the next line, used when the buffer is empty. 0 is reserved for errors.
+  uint32_t nextId = 1;
+  /// Incremented before and after every change of the lines, so it is odd while the buffer is being changed.
+  /// Lets the readers that take no lock (DumpRaw) detect that they raced with a writer.
+  std::atomic<uint32_t> generation{0};
+  /// Maximum count of consumers
+  static const uint8_t MaxConsumers = 4;
+  /// Consumers of the lines. They are kept with the positions, so a buffer in persistent or shared memory
+  /// keeps the committed ids of its consumers too.
+  BufferConsumer consumers[MaxConsumers];
+};
 
-      // Write the rest of the data to a new line.
-      memcpy(buff, data, length * sizeof(BuffT));
-      newLine.endIndex = length - 1;
-    }
+/// @brief Header of the DumpRaw output, followed by maxLines markers, bufferSize elements, pinnedMaxLines pinned markers,
+/// pinnedBufferSize pinned elements and RawDumpTrailer.
+struct RawDumpHeader
+{
+public:
+  /// RawDumpHeader::Magic
+  uint32_t magic;
+  /// Generation before the dump
+  uint32_t generation;
+  /// Size of the buffer element
+  uint32_t elementSize;
+  /// Size of the line marker
+  uint32_t markerSize;
+  /// Count of elements in the buffer
+  uint16_t bufferSize;
+  /// Maximum count of lines
+  uint16_t maxLines;
+  /// Index of the first line
+  int16_t indexFirstLine;
+  /// Index of the last line
+  int16_t indexLastLine;
+  /// Count of elements in the pinned region, 0 if it is not reserved (FlexibleCircularBuffer::ReservePinned)
+  uint16_t pinnedBufferSize;
+  /// Maximum count of pinned lines
+  uint16_t pinnedMaxLines;
+  /// Count of pinned lines, the first markers of the pinned region
+  uint16_t pinnedLineCount;
+  /// Count of elements taken by the pinned lines
+  uint16_t pinnedUsed;
+
+  static const uint32_t Magic = 0x44424346; // "FCBD"
+};
 
-    // If this is the first line, then it is the first line.
-    if (_indexLastLine == -1)
-    {
-      newLine.startIndex = 0;
-      newLine.id = 0;
-    }
-    else
+/// @brief End of the DumpRaw output. The dump is consistent if both generations are equal and even.
+struct RawDumpTrailer
+{
+public:
+  /// RawDumpTrailer::Magic
+  uint32_t magic;
+  /// Generation after the dump
+  uint32_t generation;
+
+  static const uint32_t Magic = 0x45424346; // "FCBE"
+};
+
+/// @brief circular buffer for data of different lengths
+/// @tparam BuffT Type of the buffer. Trivially copyable types are copied with memcpy,
+/// any other type is copy (or move) constructed into the buffer and destroyed when its line is evicted.
+/// If a constructor throws, the write fails with the exception and the buffer stays unlocked and consistent.
+template <typename BuffT>
+class FlexibleCircularBuffer
+{
+public:
+  /// Count of sources with their own rate limit, see SetRateLimit.
+  static const uint8_t MaxSources = 8;
+  /// Count of owners that can hold lines at once, see HoldLines.
+  static const uint8_t MaxHolds = 4;
+  /// Maximum count of observers, see AddObserver.
+  static const uint8_t MaxObservers = FlexibleCircularBuffer_MaxObservers;
+
+  /// @brief Constructor.
+  /// @param bufferSize count of elements in the buffer
+  /// @param maxLines maximum count of lines
+  /// @param resource memory resource for the data and the line markers,
+  /// for example HeapCapsMemoryResource to place the buffer in PSRAM (see FlexibleCircularBufferMemory.h)
+  FlexibleCircularBuffer(uint16_t bufferSize = 4096, uint16_t maxLines = 128,
+                         std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : _bufferSize(bufferSize),
+        _maxLines(maxLines),
+        _resource(resource),
+        _state(&_ownState)
+  {
+    // The cells are raw memory, an element is constructed only when a line is written over it.
+    buff = static_cast<BuffT *>(_resource->allocate(sizeof(BuffT) * _bufferSize, alignof(BuffT)));
+    lines = static_cast<BufferLineMarker *>(_resource->allocate(sizeof(BufferLineMarker) * _maxLines, alignof(BufferLineMarker)));
+    std::uninitialized_default_construct_n(lines, _maxLines);
+
+    // The clock is calibrated now, not by the first conversion of a time, which can be done under the lock.
+    FlexibleCircularBufferCalibrateClock<FlexibleCircularBufferClock>(0);
+    sync_init();
+  }
+
+  /// @brief Constructor, the buffer uses the storage owned by the caller, it is not freed by the buffer.
+  /// @param bufferStorage storage for the data, sizeof(BuffT) * bufferSize bytes aligned for BuffT
+  /// @param bufferSize count of elements in the buffer
+  /// @param linesStorage storage for the line markers, maxLines markers
+  /// @param maxLines maximum count of lines
+  FlexibleCircularBuffer(void *bufferStorage, uint16_t bufferSize, BufferLineMarker *linesStorage, uint16_t maxLines)
+      : buff(static_cast<BuffT *>(bufferStorage)),
+        lines(linesStorage),
+        _bufferSize(bufferSize),
+        _maxLines(maxLines),
+        _resource(nullptr),
+        _state(&_ownState)
+  {
+    std::uninitialized_default_construct_n(lines, _maxLines);
+
+    FlexibleCircularBufferCalibrateClock<FlexibleCircularBufferClock>(0);
+    sync_init();
+  }
+
+  /// @brief Constructor, attaches to the lines already written to the storage by another buffer object,
+  /// for example in shared memory (see SharedFlexibleCircularBuffer.h). Nothing is initialized or freed by this object,
+  /// and the caller has to serialize the access of all the attached objects.
+  /// @param bufferStorage storage of the data
+  /// @param bufferSize count of elements in the buffer
+  /// @param linesStorage storage of the line markers
+  /// @param maxLines maximum count of lines
+  /// @param state positions of the lines
+  FlexibleCircularBuffer(void *bufferStorage, uint16_t bufferSize, BufferLineMarker *linesStorage, uint16_t maxLines,
+                         BufferRingState *state)
+      : buff(static_cast<BuffT *>(bufferStorage)),
+        lines(linesStorage),
+        _bufferSize(bufferSize),
+        _maxLines(maxLines),
+        _resource(nullptr),
+        _state(state)
+  {
+    FlexibleCircularBufferCalibrateClock<FlexibleCircularBufferClock>(0);
+    sync_init();
+  }
+
+  ~FlexibleCircularBuffer()
+  {
+    // Destroy the elements of all live lines, unless they belong to an external state.
+    // The observers are not notified about it.
+    for (uint8_t i = 0; i < MaxObservers; i++)
+      _observers[i] = nullptr;
+    while (_state == &_ownState && _state->indexFirstLine != -1)
+      evictFirstLine();
+
+    SetCompaction(false);
+    releasePinned();
+
+    if (_resource != nullptr)
     {
-      // Otherwise, we need to find the start index of the new line.
-      newLine.startIndex = (lines[_indexLastLine].endIndex + 1) % _bufferSize;
-      newLine.id = lines[_indexLastLine].id + 1;
+      _resource->deallocate(buff, sizeof(BuffT) * _bufferSize, alignof(BuffT));
+      _resource->deallocate(lines, sizeof(BufferLineMarker) * _maxLines, alignof(BufferLineMarker));
     }
 
-    // if the data of the line we just recorded intersects with the previously recorded lines,
-    // then we erase the data about the overwritten lines.
-    if (_indexFirstLine == -1)
-      _indexFirstLine = nextIndex;
-    else
-      FixIntersection(newLine);
+#ifdef ThreadSafe
+#if ThreadSafe == FreeRTOS
+    vSemaphoreDelete(sync_mutex);
+#endif
+#endif
+  }
 
-    // Set the new line as the last line.
-    _indexLastLine = nextIndex;
-    lines[_indexLastLine] = newLine;
+  // The buffer owns its storage and the mutex, so it cannot be copied.
+  FlexibleCircularBuffer(const FlexibleCircularBuffer &) = delete;
+  FlexibleCircularBuffer &operator=(const FlexibleCircularBuffer &) = delete;
 
-    sync_unlock();
+  /// @brief Write new line to buffer
+  /// @param data data
+  /// @param length data length
+  /// @return id of the created line. 0 if error
+  uint32_t WriteLine(const BuffT *data, uint16_t length)
+  {
+    return appendLine(data, length, LineWriteOptions());
+  }
 
-    // Return the id of the new line.
-    return newLine.id;
+  /// @brief Write new line to buffer
+  /// @param data data
+  /// @param length data length
+  /// @param options settings of the line
+  /// @return id of the created line. 0 if error
+  uint32_t WriteLine(const BuffT *data, uint16_t length, const LineWriteOptions &options)
+  {
+    return appendLine(data, length, options);
+  }
+
+  /// @brief Write new line to buffer, the elements are moved from data instead of being copied.
+  /// For trivially copyable types it is the same as WriteLine.
+  /// @param data data, the elements are left in a moved-from state
+  /// @param length data length
+  /// @return id of the created line. 0 if error
+  uint32_t MoveLine(BuffT *data, uint16_t length)
+  {
+    return appendLine(data, length, LineWriteOptions());
   }
 
   /// @brief add data to last line
@@ -229,88 +733,671 @@ public:
   /// @return id of the created line. 0 if error
   uint32_t WriteToLastLine(uint32_t id, const BuffT *data, uint16_t length)
   {
-    if (_indexLastLine == -1 || id != lines[_indexLastLine].id ||
-        calculateLineLength(lines[_indexLastLine]) > _bufferSize / 2)
+    SyncGuard lock(*this);
+
+    if (_state->indexLastLine == -1 || id != lines[_state->indexLastLine].id || isGroupOfOtherWriter() ||
+        calculateLineLength(lines[_state->indexLastLine]) + length > _bufferSize / 2)
       return 0;
 
-    // if the data fits into the buffer without fragmentation, then we simply write it to the buffer
-    if ((lines[_indexLastLine].endIndex + length + 1) < _bufferSize)
+    if (length > 0)
     {
-      memcpy(buff + lines[_indexLastLine].endIndex + 1, data, length * sizeof(BuffT));
-      lines[_indexLastLine].endIndex = lines[_indexLastLine].endIndex + length;
-    }
-    else
-    {
-      // Otherwise, we need to split the line.
-      memcpy(buff + lines[_indexLastLine].endIndex + 1, data,
-             (_bufferSize - lines[_indexLastLine].endIndex - 1) * sizeof(BuffT));
-      lines[_indexLastLine].endIndex = _bufferSize - lines[_indexLastLine].endIndex - 1;
-      data += lines[_indexLastLine].endIndex;
-      length -= lines[_indexLastLine].endIndex;
+      // The appended data starts right after the current end of the line.
+      uint16_t startIndex = (lines[_state->indexLastLine].endIndex + 1) % _bufferSize;
 
-      // Write the rest of the data to a new line.
-      memcpy(buff, data, length * sizeof(BuffT));
-      lines[_indexLastLine].endIndex = length - 1;
-    }
+      BufferLineMarker grownLine = lines[_state->indexLastLine];
+      grownLine.endIndex = (lines[_state->indexLastLine].endIndex + length) % _bufferSize;
 
-    FixIntersection(lines[_indexLastLine]);
+      if (!canOverwrite(grownLine, false))
+        return 0;
+
+      {
+        ChangeGuard change(*this);
+        // Free the cells of the overwritten lines before constructing the new data on them.
+        FixIntersection(grownLine);
+        copyIn(startIndex, data, length);
+        lines[_state->indexLastLine].endIndex = grownLine.endIndex;
+      }
+      notifyWritten(_state->indexLastLine);
+      checkPressure();
+    }
 
     return id;
   }
 
+  /// @brief Replace the data of a line in place, for example a periodic status line, so no space is taken
+  /// and no line is evicted. The line keeps its id and its time.
+  /// @param id id of the line
+  /// @param data new data
+  /// @param length data length, the same as the length of the line
+  /// Elements that are not trivially copyable are copy assigned over the old ones.
+  /// @return false if the line was not found, has expired or was superseded, has another length or is held (HoldLines)
+  bool UpdateLine(uint32_t id, const BuffT *data, uint16_t length)
+  {
+    SyncGuard lock(*this);
+
+    int16_t index = isGroupOfOtherWriter() ? -1 : findIndex(id);
+    bool ret = index >= 0 && !lines[index].isStale(FlexibleCircularBufferClock::Now()) &&
+               calculateLineLength(lines[index]) == length && !isHeld(id);
+    if (ret)
+    {
+      {
+        ChangeGuard change(*this);
+        assignIn(lines[index].startIndex, data, length);
+      }
+      notifyUpdated(index);
+    }
+
+    return ret;
+  }
+
   /// @brief Read the first buffer line
   /// @return BufferLine or nullptr if empty
   BufferLine<BuffT> *ReadFirst()
   {
-    if (_indexFirstLine < 0)
-      return nullptr;
-
-    sync_lock();
-    BufferLine<BuffT> *ret = CreateBufferLine(_indexFirstLine);
-    sync_unlock();
-    return ret;
+    SyncGuard lock(*this);
+    int16_t index = skipStale(_state->indexFirstLine, FlexibleCircularBufferClock::Now());
+    return index < 0 ? nullptr : CreateBufferLine(index);
   }
 
   /// @brief Read the last buffer line
   /// @return BufferLine or nullptr if empty
   BufferLine<BuffT> *ReadLast()
   {
-    if (_indexLastLine < 0)
-      return nullptr;
-
-    sync_lock();
-    BufferLine<BuffT> *ret = CreateBufferLine(_indexLastLine);
-    sync_unlock();
-    return ret;
+    SyncGuard lock(*this);
+    uint64_t now = FlexibleCircularBufferClock::Now();
+    int16_t index = lastVisibleIndex();
+    while (index >= 0 && lines[index].isStale(now))
+      index = index == _state->indexFirstLine ? -1 : getPrevIndex(index);
+    return index < 0 ? nullptr : CreateBufferLine(index);
   }
 
   /// @brief Read the next buffer line with given id
   /// @return BufferLine or nullptr if not found
   BufferLine<BuffT> *ReadNext(uint32_t id)
   {
-    if (_indexLastLine < 0)
-      return nullptr;
-
-    sync_lock();
+    SyncGuard lock(*this);
     BufferLine<BuffT> *ret = nullptr;
 
-    // Find the next line with given id
-    for (int16_t index = _indexFirstLine; index != _indexLastLine; index = getNextIndex(index))
-    {
-      // If the current line has the given id, return it
-      if (lines[index].id == id)
-      {
-        ret = CreateBufferLine(getNextIndex(index));
-        break;
-      }
-    }
-
-    sync_unlock();
+    // Find the line with given id, the next one that is not stale follows it
+    int16_t index = findVisibleIndex(id);
+    if (index >= 0 && index != lastVisibleIndex())
+      index = skipStale(getNextIndex(index), FlexibleCircularBufferClock::Now());
+    else
+      index = -1;
+    if (index >= 0)
+      ret = CreateBufferLine(index);
 
     // If there are no more lines, return nullptr
     return ret;
   }
 
+  /// @brief Add an observer of the buffer events.
+  /// @return false if there are already MaxObservers observers
+  bool AddObserver(FlexibleCircularBufferObserver<BuffT> *observer)
+  {
+    SyncGuard lock(*this);
+    bool ret = false;
+    for (uint8_t i = 0; i < MaxObservers && !ret; i++)
+    {
+      if (_observers[i] == nullptr)
+      {
+        _observers[i] = observer;
+        ret = true;
+      }
+    }
+    return ret;
+  }
+
+  /// @brief Remove the observer, after return it is not called anymore.
+  void RemoveObserver(FlexibleCircularBufferObserver<BuffT> *observer)
+  {
+    SyncGuard lock(*this);
+    for (uint8_t i = 0; i < MaxObservers; i++)
+      if (_observers[i] == observer)
+        _observers[i] = nullptr;
+  }
+
+  /// @brief Keep the lines starting from the given id from being overwritten, for example while they are
+  /// written to a file asynchronously, straight from the buffer memory. While the lines are held,
+  /// a write that would overwrite one of them fails and returns 0.
+  /// Each owner has its own hold (up to MaxHolds), a new call of the same owner moves it.
+  /// @param fromId id of the oldest held line, the newer lines are held too
+  /// @param owner owner of the hold, for example the object that writes the lines
+  /// @return false if MaxHolds other owners hold lines
+  bool HoldLines(uint32_t fromId, const void *owner = nullptr)
+  {
+    SyncGuard lock(*this);
+    LineHold *hold = findHold(owner);
+    if (hold == nullptr)
+    {
+      hold = findHold(nullptr, false);
+      if (hold == nullptr)
+        return false;
+      hold->owner = owner;
+      hold->active = true;
+    }
+    hold->fromId = fromId;
+    return true;
+  }
+
+  /// @brief Allow the lines held by the owner to be overwritten again.
+  /// @param owner owner of the hold, see HoldLines
+  void ReleaseLines(const void *owner = nullptr)
+  {
+    SyncGuard lock(*this);
+    LineHold *hold = findHold(owner);
+    if (hold != nullptr)
+      *hold = LineHold();
+  }
+
+  /// @brief Start a group of lines, for example a header and its detail rows. The lines written by this writer
+  /// until CommitGroup become visible to the readers at once, and they are evicted together, so a reader never sees
+  /// a part of the group. The writes of the other writers wait until the group is committed.
+  /// A group must fit in the buffer: a write that would overwrite the first line of its own group fails and returns 0.
+  /// The observers get OnLineWritten for the lines of the group when it is committed.
+  /// Not for a buffer attached to an external state (SharedFlexibleCircularBuffer): the group is kept in the buffer object,
+  /// so the other processes would see and evict a part of it.
+  /// @return false if this writer has already started a group, or the buffer is attached to an external state
+  bool BeginGroup()
+  {
+    SyncGuard lock(*this);
+    while (isGroupOfOtherWriter())
+      waitCommit();
+    bool ret = !_groupOpen && _state == &_ownState;
+    if (ret)
+    {
+      _groupOpen = true;
+      _groupFromId = _state->nextId;
+      setGroupOwner();
+    }
+    return ret;
+  }
+
+  /// @brief Make the lines of the group visible to the readers.
+  /// @return false if this writer has not started a group
+  bool CommitGroup()
+  {
+    SyncGuard lock(*this);
+    bool ret = _groupOpen && !isGroupOfOtherWriter();
+    if (ret)
+    {
+      _groupOpen = false;
+      // The lines of the group are published to the observers at once, now that the readers can see them.
+      int16_t index = findIndex(_groupFromId);
+      for (; index >= 0; index = index == _state->indexLastLine ? -1 : getNextIndex(index))
+        notifyWritten(index);
+      notifyCommit();
+    }
+    return ret;
+  }
+
+  /// @brief Get the count of writes that failed because they would overwrite held lines.
+  uint32_t GetRejectedWrites()
+  {
+    SyncGuard lock(*this);
+    return _rejectedWrites;
+  }
+
+  /// @brief Add a named consumer, the lines it has not committed are not overwritten (depending on the policy).
+  /// If a consumer with this name already exists, for example in a buffer attached to persistent memory after a reboot,
+  /// its committed id is kept, so the consumer resumes where it stopped.
+  /// A new consumer has not committed any of the lines in the buffer.
+  /// @param name name of the consumer, shorter than BufferConsumer::MaxNameLength
+  /// @param policy what the writer does with the lines not committed yet
+  /// @return false if the name is too long, there are already BufferRingState::MaxConsumers consumers,
+  /// or the policy is ConsumerPolicy::Block and the buffer is attached to an external state
+  bool AddConsumer(const char *name, ConsumerPolicy policy = ConsumerPolicy::Reject)
+  {
+    if (name == nullptr || name[0] == '\0' || strlen(name) >= BufferConsumer::MaxNameLength)
+      return false;
+    if (policy == ConsumerPolicy::Block && _state != &_ownState)
+      return false;
+
+    SyncGuard lock(*this);
+    BufferConsumer *consumer = findConsumer(name);
+    if (consumer == nullptr)
+    {
+      consumer = findConsumer("");
+      if (consumer != nullptr)
+      {
+        strcpy(consumer->name, name);
+        consumer->committedId = (_state->indexFirstLine >= 0 ? lines[_state->indexFirstLine].id : _state->nextId) - 1;
+        consumer->lost = 0;
+      }
+    }
+    if (consumer != nullptr)
+    {
+      consumer->policy = policy;
+      checkPressure();
+    }
+    return consumer != nullptr;
+  }
+
+  /// @brief Remove the consumer, its lines can be overwritten again.
+  void RemoveConsumer(const char *name)
+  {
+    SyncGuard lock(*this);
+    BufferConsumer *consumer = findConsumer(name);
+    if (consumer != nullptr)
+      *consumer = BufferConsumer();
+    notifyCommit();
+    checkPressure();
+  }
+
+  /// @brief Mark the lines up to the given id as processed by the consumer, so they can be overwritten.
+  /// An id older than the committed one is ignored.
+  /// @return false if there is no such consumer
+  bool CommitConsumer(const char *name, uint32_t id)
+  {
+    SyncGuard lock(*this);
+    BufferConsumer *consumer = findConsumer(name);
+    if (consumer != nullptr && (int32_t)(id - consumer->committedId) > 0)
+    {
+      consumer->committedId = id;
+      notifyCommit();
+      checkPressure();
+    }
+    return consumer != nullptr;
+  }
+
+  /// @brief Get the id of the last line committed by the consumer, the consumer continues from the next one.
+  /// @return false if there is no such consumer
+  bool GetConsumerOffset(const char *name, uint32_t &committedId)
+  {
+    SyncGuard lock(*this);
+    BufferConsumer *consumer = findConsumer(name);
+    if (consumer != nullptr)
+      committedId = consumer->committedId;
+    return consumer != nullptr;
+  }
+
+  /// @brief Get the count of lines overwritten before the consumer committed them, without the stale lines.
+  uint32_t GetConsumerLosses(const char *name)
+  {
+    SyncGuard lock(*this);
+    BufferConsumer *consumer = findConsumer(name);
+    return consumer != nullptr ? consumer->lost : 0;
+  }
+
+  /// @brief Reserve the pinned region, a separate part of the buffer for the lines written with WritePinned.
+  /// The pinned lines are never evicted, a pinned write fails when the region is full.
+  /// @param bufferSize count of elements in the region
+  /// @param maxLines maximum count of pinned lines
+  /// @return false if the region is already reserved
+  bool ReservePinned(uint16_t bufferSize, uint16_t maxLines)
+  {
+    SyncGuard lock(*this);
+    bool ret = _pinnedBuff == nullptr && bufferSize > 0 && maxLines > 0;
+    if (ret)
+    {
+      // DumpRaw reads the region without the lock.
+      ChangeGuard change(*this);
+      std::pmr::memory_resource *resource = _resource != nullptr ? _resource : std::pmr::get_default_resource();
+      _pinnedBuff = static_cast<BuffT *>(resource->allocate(sizeof(BuffT) * bufferSize, alignof(BuffT)));
+      _pinnedLines = static_cast<BufferLineMarker *>(resource->allocate(sizeof(BufferLineMarker) * maxLines, alignof(BufferLineMarker)));
+      _pinnedBufferSize = bufferSize;
+      _pinnedMaxLines = maxLines;
+    }
+    return ret;
+  }
+
+  /// @brief Write a line to the pinned region (ReservePinned), where it is never evicted, for example a boot banner
+  /// or the firmware version. The pinned lines are not in the id sequence of the ring, so the result is not an id
+  /// and must not be passed to the methods that take one. The observers get OnLineWritten with BufferLineView::pinned set.
+  /// @param data data
+  /// @param length data length
+  /// @param options only the timestamp applies to a pinned line
+  /// @return position of the line in the region + 1, 0 if the region is not reserved or is full
+  uint16_t WritePinned(const BuffT *data, uint16_t length, const LineWriteOptions &options = LineWriteOptions())
+  {
+    if (length == 0)
+      return 0;
+
+    SyncGuard lock(*this);
+    uint16_t position;
+    {
+      ChangeGuard change(*this);
+      position = appendPinned(data, length, options);
+    }
+    if (position > 0)
+      for (uint8_t i = 0; i < MaxObservers; i++)
+        if (_observers[i] != nullptr)
+          _observers[i]->OnLineWritten(createPinnedView(position - 1));
+    return position;
+  }
+
+  /// @brief Remove all the pinned lines, the region stays reserved.
+  void ClearPinned()
+  {
+    SyncGuard lock(*this);
+    ChangeGuard change(*this);
+    clearPinned();
+  }
+
+  /// @brief Pass the pinned lines to the visitor in order.
+  /// The buffer is locked while the visitor runs, so the visitor must not write to this buffer.
+  /// @param visitor callable with (const BufferLineView<BuffT> &), returns false to stop
+  /// @return count of visited lines
+  template <typename Visitor>
+  uint16_t VisitPinned(Visitor &&visitor)
+  {
+    SyncGuard lock(*this);
+    uint16_t count = 0;
+    while (count < _pinnedLineCount)
+      if (!visitor(createPinnedView(count++)))
+        break;
+    return count;
+  }
+
+  /// @brief Pass the pinned lines and then all the lines of the buffer to the visitor, for example for a support dump.
+  /// @param visitor callable with (const BufferLineView<BuffT> &), returns false to stop
+  /// @return count of visited lines
+  template <typename Visitor>
+  uint32_t VisitAll(Visitor &&visitor)
+  {
+    bool stopped = false;
+    uint32_t count = VisitPinned([&](const BufferLineView<BuffT> &line)
+                                 { stopped = !visitor(line);
+                                   return !stopped; });
+    uint32_t firstId, lastId;
+    if (!stopped && GetIdRange(firstId, lastId))
+      count += VisitLines(firstId, visitor);
+    return count;
+  }
+
+  /// @brief Set the watermarks of the occupancy. When the pending lines reach a high watermark, the observers get
+  /// OnPressureChanged(true), and when they are back under both low watermarks, OnPressureChanged(false),
+  /// for example to lower the verbosity of the logs while a drainer cannot keep up.
+  /// The pending lines are the lines not committed by all the consumers. Without consumers no line is pending:
+  /// the buffer is always full once it wrapped, so the watermarks need a consumer, for example the one committed
+  /// by FlexibleCircularBufferDrainer::SetConsumer. The occupancy is calculated from the positions of the lines after each write and commit, without a scan.
+  void SetWatermarks(const BufferWatermarks &watermarks)
+  {
+    SyncGuard lock(*this);
+    _watermarks = watermarks;
+    checkPressure();
+  }
+
+  /// @brief Check if the buffer is over a high watermark, see SetWatermarks.
+  bool IsUnderPressure()
+  {
+    SyncGuard lock(*this);
+    return _underPressure;
+  }
+
+  /// @brief Get the occupancy of the pending lines, see SetWatermarks.
+  /// @param cells count of elements taken by the pending lines
+  /// @param lineCount count of pending lines
+  void GetOccupancy(uint16_t &cells, uint16_t &lineCount)
+  {
+    SyncGuard lock(*this);
+    getOccupancy(cells, lineCount);
+  }
+
+  /// @brief Enable or disable the suppression of duplicate lines, disabled by default.
+  /// When enabled, a line equal to the last line is not stored again: the repeat count of the last line is incremented
+  /// and its id is returned, so a storm of the same message does not overwrite the history. The line must also have
+  /// the same key, ttl and source as the last line. The observers get OnLineUpdated with the new repeat count.
+  /// Only trivially copyable types are compared. Note that WriteToLastLine after a suppressed write extends the repeated line.
+  void SetDeduplicate(bool deduplicate)
+  {
+    SyncGuard lock(*this);
+    _deduplicate = deduplicate;
+  }
+
+  /// @brief Enable or disable the compaction by keys, disabled by default. When enabled, a line written with
+  /// a key (LineWriteOptions::key) supersedes the previous line with the same key: the superseded line is skipped
+  /// by the readers and its space is reclaimed as soon as it reaches the head of the buffer, and VisitLatest
+  /// finds the latest line of a key through a hash index. Enabling it indexes the lines already in the buffer.
+  /// The compaction only hides the older lines of a key: the latest line is evicted like any other line when the
+  /// writes wrap around to it, then the key has no line. Write a state again before that, or pin it (ReservePinned).
+  void SetCompaction(bool compaction)
+  {
+    SyncGuard lock(*this);
+    std::pmr::memory_resource *resource = _resource != nullptr ? _resource : std::pmr::get_default_resource();
+    if (compaction && _keyIndex == nullptr)
+    {
+      // There is at most one latest line per marker, so the index is never more than half full.
+      uint32_t size = 2;
+      while (size < 2u * _maxLines)
+        size *= 2;
+      _keyIndex = static_cast<int16_t *>(resource->allocate(sizeof(int16_t) * size, alignof(int16_t)));
+      _keyIndexMask = size - 1;
+      for (uint32_t slot = 0; slot < size; slot++)
+        _keyIndex[slot] = -1;
+
+      ChangeGuard change(*this);
+      for (int16_t index = _state->indexFirstLine; index >= 0; index = index == _state->indexLastLine ? -1 : getNextIndex(index))
+        if (lines[index].key != 0 && (lines[index].flags & BufferLineMarker::Superseded) == 0)
+          supersede(index);
+    }
+    else if (!compaction && _keyIndex != nullptr)
+    {
+      resource->deallocate(_keyIndex, sizeof(int16_t) * (_keyIndexMask + 1u), alignof(int16_t));
+      _keyIndex = nullptr;
+    }
+  }
+
+  /// @brief Pass the latest line of the key to the visitor, see SetCompaction.
+  /// The buffer is locked while the visitor runs, so the visitor must not write to this buffer.
+  /// @param key key of the line, not 0
+  /// @param visitor callable with (const BufferLineView<BuffT> &)
+  /// @return false if the compaction is disabled, or the latest line of the key was evicted, has expired or is not committed yet (BeginGroup)
+  template <typename Visitor>
+  bool VisitLatest(uint16_t key, Visitor &&visitor)
+  {
+    SyncGuard lock(*this);
+    int16_t index = -1;
+    if (_keyIndex != nullptr && key != 0)
+    {
+      index = _keyIndex[findKeySlot(key)];
+      if (index >= 0 && (findVisibleIndex(lines[index].id) < 0 || lines[index].isExpired(FlexibleCircularBufferClock::Now())))
+        index = -1;
+    }
+    if (index >= 0)
+      visitor(createLineView(index));
+    return index >= 0;
+  }
+
+  /// @brief Limit the rate of the lines of a source (LineWriteOptions::sourceId) with a token bucket,
+  /// so one source cannot overwrite the lines of the others. A line that exceeds the limit is dropped and WriteLine returns 0.
+  /// For text, a line "dropped N lines of source S" is written before the next accepted line of the source,
+  /// or before the next accepted line of any source once the first drop is a second old (see FlushDropSummaries).
+  /// @param sourceId id of the source, less than MaxSources, the other sources are not limited
+  /// @param rate elements per second, 0 to remove the limit
+  /// @param burst maximum count of elements written at once, at least the length of the longest line
+  void SetRateLimit(uint8_t sourceId, uint32_t rate, uint32_t burst)
+  {
+    if (sourceId >= MaxSources)
+      return;
+    SyncGuard lock(*this);
+    SourceBucket &source = _sources[sourceId];
+    source.rate = rate;
+    source.burst = burst;
+    source.tokens = (uint64_t)burst * 1000000;
+    source.refilledAt = FlexibleCircularBufferClock::Now();
+  }
+
+  /// @brief Get the count of lines of the source dropped by the rate limit.
+  uint32_t GetDroppedWrites(uint8_t sourceId)
+  {
+    if (sourceId >= MaxSources)
+      return 0;
+    SyncGuard lock(*this);
+    return _sources[sourceId].dropped;
+  }
+
+  /// @brief Write the summaries of the lines dropped by the rate limit that were not reported yet.
+  /// The summaries are written by the writes, so call it periodically if the buffer may stay idle after a burst.
+  void FlushDropSummaries()
+  {
+    SyncGuard lock(*this);
+    for (uint8_t sourceId = 0; sourceId < MaxSources; sourceId++)
+      writeDropSummary(sourceId);
+  }
+
+  /// @brief Get the memory of the data, for example to register it for asynchronous I/O.
+  const BuffT *GetStorage() const
+  {
+    return buff;
+  }
+
+  /// @brief Get the count of elements in the buffer.
+  uint16_t GetBufferSize() const
+  {
+    return _bufferSize;
+  }
+
+  /// @brief Get the maximum count of lines.
+  uint16_t GetMaxLines() const
+  {
+    return _maxLines;
+  }
+
+  /// @brief Copy the markers of the lines that have not expired or were superseded, in order, so the lines can be read without
+  /// blocking the writers (with ViewOfMarker). Such a reader must check afterwards that a line was not overwritten
+  /// while it was read: it was not if its id is still at least the id of the first line (GetIdRange).
+  /// Only for trivially copyable types, and note that WriteToLastLine and UpdateLine change the data in place (see GetGeneration).
+  /// @param to destination, at least GetMaxLines() markers
+  /// @param generation if not nullptr, set to the generation of the copied markers: if GetGeneration still returns it
+  /// after the data was read, no line was changed meanwhile
+  /// @return count of copied markers
+  uint16_t CopyLineMarkers(BufferLineMarker *to, uint32_t *generation = nullptr)
+  {
+    SyncGuard lock(*this);
+    if (generation != nullptr)
+      *generation = _state->generation.load(std::memory_order_relaxed);
+    uint16_t count = 0;
+    uint64_t now = FlexibleCircularBufferClock::Now();
+    int16_t last = lastVisibleIndex();
+    for (int16_t index = last < 0 ? -1 : _state->indexFirstLine; index >= 0; index = index == last ? -1 : getNextIndex(index))
+      if (!lines[index].isStale(now))
+        to[count++] = lines[index];
+    return count;
+  }
+
+  /// @brief Create a view of the line of a marker copied by CopyLineMarkers, without the lock.
+  /// The data is read while writers may change it, see CopyLineMarkers.
+  BufferLineView<BuffT> ViewOfMarker(const BufferLineMarker &line) const
+  {
+    BufferLineView<BuffT> view;
+    view.id = line.id;
+    view.timestamp = line.timestamp;
+    view.repeatCount = line.repeatCount;
+    view.key = line.key;
+    view.ttl = line.ttl;
+    view.first = buff + line.startIndex;
+    if (line.startIndex <= line.endIndex)
+      view.firstLength = line.endIndex - line.startIndex + 1;
+    else
+    {
+      view.firstLength = _bufferSize - line.startIndex;
+      view.second = buff;
+      view.secondLength = line.endIndex + 1;
+    }
+    return view;
+  }
+
+  /// @brief Get the generation of the lines, it is odd while they are changed and grows with every change.
+  /// A reader of ViewOfMarker can compare it before and after reading: if it did not change and is even,
+  /// no line was written, updated or moved meanwhile.
+  uint32_t GetGeneration() const
+  {
+    return _state->generation.load(std::memory_order_acquire);
+  }
+
+  /// @brief Set the id of the next line, for example to continue the ids of an archive after a restart.
+  /// @param id id of the next line, not 0
+  /// @return false if the buffer is not empty
+  bool SetNextId(uint32_t id)
+  {
+    SyncGuard lock(*this);
+    bool ret = _state->indexFirstLine < 0 && id != 0;
+    if (ret)
+      _state->nextId = id;
+    return ret;
+  }
+
+  /// @brief Get the ids of the first and the last lines.
+  /// The range includes the lines that have expired or were superseded and were not evicted yet, see VisitLines with scannedId.
+  /// @return false if the buffer is empty
+  bool GetIdRange(uint32_t &firstId, uint32_t &lastId)
+  {
+    SyncGuard lock(*this);
+    int16_t last = lastVisibleIndex();
+    bool ret = last >= 0;
+    if (ret)
+    {
+      firstId = lines[_state->indexFirstLine].id;
+      lastId = lines[last].id;
+    }
+    return ret;
+  }
+
+  /// @brief Pass the line with given id to the visitor without copying its data.
+  /// The buffer is locked while the visitor runs, so the visitor must not write to this buffer.
+  /// @param id id of the line
+  /// @param visitor callable with (const BufferLineView<BuffT> &)
+  /// @return false if the line was not found, has expired or was superseded
+  template <typename Visitor>
+  bool VisitLine(uint32_t id, Visitor &&visitor)
+  {
+    SyncGuard lock(*this);
+    int16_t index = findVisibleIndex(id);
+    if (index >= 0 && lines[index].isStale(FlexibleCircularBufferClock::Now()))
+      index = -1;
+    if (index >= 0)
+      visitor(createLineView(index));
+    return index >= 0;
+  }
+
+  /// @brief Pass the lines to the visitor in order, starting from the line with given id
+  /// (or from the first line, if that line was already overwritten).
+  /// The buffer is locked while the visitor runs, so the visitor must not write to this buffer.
+  /// @param fromId id of the first line to visit
+  /// @param visitor callable with (const BufferLineView<BuffT> &), returns false to stop
+  /// @return count of visited lines
+  template <typename Visitor>
+  uint16_t VisitLines(uint32_t fromId, Visitor &&visitor)
+  {
+    uint32_t scannedId;
+    return VisitLines(fromId, visitor, scannedId);
+  }
+
+  /// @brief Pass the lines to the visitor in order, as VisitLines, and report how far the lines were scanned.
+  /// GetIdRange includes the lines that have expired or were superseded, so a reader that goes up to its last id
+  /// moves to scannedId + 1 when no line was visited, instead of waiting for the skipped lines.
+  /// @param fromId id of the first line to visit
+  /// @param visitor callable with (const BufferLineView<BuffT> &), returns false to stop
+  /// @param scannedId set to the id of the last line passed to the visitor or skipped, unchanged if there was no line
+  /// @return count of visited lines
+  template <typename Visitor>
+  uint16_t VisitLines(uint32_t fromId, Visitor &&visitor, uint32_t &scannedId)
+  {
+    SyncGuard lock(*this);
+    uint16_t count = 0;
+    int16_t last = lastVisibleIndex();
+    if (last >= 0)
+    {
+      int16_t index = findVisibleIndex(fromId);
+      // if the line is older than the first line, start from the first one.
+      if (index < 0 && (int32_t)(fromId - lines[_state->indexFirstLine].id) < 0)
+        index = _state->indexFirstLine;
+
+      uint64_t now = FlexibleCircularBufferClock::Now();
+      for (; index >= 0; index = index == last ? -1 : getNextIndex(index))
+      {
+        scannedId = lines[index].id;
+        if (lines[index].isStale(now))
+          continue;
+        count++;
+        if (!visitor(createLineView(index)))
+          break;
+      }
+    }
+    return count;
+  }
+
   // Delete the current one, and return next line.
   BufferLine<BuffT> *FreeAndReadNext(BufferLine<BuffT> *line)
   {
@@ -322,6 +1409,48 @@ public:
     return ReadNext(id);
   }
 
+#ifdef FlexibleCircularBuffer_RawDump
+
+  /// @brief Write the markers and the data to the file descriptor as they are in memory.
+  /// Async-signal-safe: takes no lock and uses only write(), so it can be called from a SIGSEGV/SIGABRT handler
+  /// to keep the last lines of a crashing process. The output is RawDumpHeader, maxLines markers,
+  /// bufferSize elements, the markers and the elements of the pinned region, and RawDumpTrailer.
+  /// The pinned markers have the positions of their lines in the pinned elements.
+  /// @param fd file descriptor
+  /// @return true if everything was written and no writer changed the buffer during the dump
+  bool DumpRaw(int fd)
+  {
+    RawDumpHeader header;
+    header.magic = RawDumpHeader::Magic;
+    header.generation = _state->generation.load(std::memory_order_acquire);
+    header.elementSize = sizeof(BuffT);
+    header.markerSize = sizeof(BufferLineMarker);
+    header.bufferSize = _bufferSize;
+    header.maxLines = _maxLines;
+    header.indexFirstLine = _state->indexFirstLine;
+    header.indexLastLine = _state->indexLastLine;
+    header.pinnedBufferSize = _pinnedBuff != nullptr ? _pinnedBufferSize : 0;
+    header.pinnedMaxLines = _pinnedBuff != nullptr ? _pinnedMaxLines : 0;
+    header.pinnedLineCount = _pinnedLineCount;
+    header.pinnedUsed = _pinnedUsed;
+
+    bool written = writeAll(fd, &header, sizeof(header)) &&
+                   writeAll(fd, lines, sizeof(BufferLineMarker) * _maxLines) &&
+                   writeAll(fd, buff, sizeof(BuffT) * _bufferSize) &&
+                   writeAll(fd, _pinnedLines, sizeof(BufferLineMarker) * header.pinnedMaxLines) &&
+                   writeAll(fd, _pinnedBuff, sizeof(BuffT) * header.pinnedBufferSize);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    RawDumpTrailer trailer;
+    trailer.magic = RawDumpTrailer::Magic;
+    trailer.generation = _state->generation.load(std::memory_order_relaxed);
+    written = written && writeAll(fd, &trailer, sizeof(trailer));
+
+    return written && header.generation == trailer.generation && (header.generation & 1) == 0;
+  }
+
+#endif
+
 #ifdef DebugMode_FlexibleCircularBuffer
 
   void SnapshotToFile(const char *outFileName, const char *firstHtmlFilePath, const char *lastHtmlFilePath)
@@ -335,7 +1464,7 @@ public:
     file << "  <p style=\"margin: 4px;\">BufferSize: " << _bufferSize << ", MaxLines: " << _maxLines << "</p>\n";
     file << "  <p style=\"margin: 4px;\">Buffer cells:</p>\n";
     pushBuffer(file);
-    file << "  <p style=\"margin: 4px;\">IndexFirstLine: " << _indexFirstLine << ", IndexLastLine: " << _indexLastLine << "</p>\n";
+    file << "  <p style=\"margin: 4px;\">IndexFirstLine: " << _state->indexFirstLine << ", IndexLastLine: " << _state->indexLastLine << "</p>\n";
     file << "  <p style=\"margin: 4px;\">Lines:</p>";
     pushLines(file);
     copyContent(file, lastHtmlFilePath);
@@ -355,11 +1484,104 @@ private:
   // Maximum number of lines
   const uint16_t _maxLines;
 
-  // Index of the first line
-  int16_t _indexFirstLine = -1;
+  // Memory resource of buff and lines, nullptr if the storage is owned by the caller.
+  std::pmr::memory_resource *const _resource;
+
+  // Positions of the lines, _ownState unless the buffer is attached to an external state.
+  BufferRingState _ownState;
+  BufferRingState *const _state;
+
+  /// Lines kept from being overwritten by an owner, see HoldLines.
+  struct LineHold
+  {
+    // Owner of the hold
+    const void *owner = nullptr;
+    // Id of the oldest held line
+    uint32_t fromId = 0;
+    // Set while the slot is used
+    bool active = false;
+  };
+
+  // Holds of the owners
+  LineHold _holds[MaxHolds];
+  // Count of writes that failed because of the held lines
+  uint32_t _rejectedWrites = 0;
+
+  // Set if a line equal to the last line only increments its repeat count.
+  bool _deduplicate = false;
+
+  // Occupancy limits of the pending lines
+  BufferWatermarks _watermarks;
+  // Set after a high watermark was reached, until the buffer is back under the low watermarks
+  bool _underPressure = false;
+
+  // Pinned region: its lines are written one after another and never evicted, nullptr unless reserved.
+  BuffT *_pinnedBuff = nullptr;
+  BufferLineMarker *_pinnedLines = nullptr;
+  // Count of elements in the pinned region
+  uint16_t _pinnedBufferSize = 0;
+  // Maximum count of pinned lines
+  uint16_t _pinnedMaxLines = 0;
+  // Count of used elements of the pinned region
+  uint16_t _pinnedUsed = 0;
+  // Count of pinned lines
+  uint16_t _pinnedLineCount = 0;
+
+  // Marker index of the latest line of each key, open addressing with linear probing, -1 for an empty slot.
+  // nullptr unless the compaction is enabled.
+  int16_t *_keyIndex = nullptr;
+  // Count of slots of _keyIndex - 1
+  uint16_t _keyIndexMask = 0;
+
+  // Set while a group of lines is written, the lines starting from _groupFromId are not visible to the readers.
+  bool _groupOpen = false;
+  // Id of the first line of the group
+  uint32_t _groupFromId = 0;
+#ifdef ThreadSafe
+#if ThreadSafe == FreeRTOS
+  // Task that writes the group
+  TaskHandle_t _groupOwner = nullptr;
+#elif ThreadSafe == StdMutex
+  // Thread that writes the group
+  std::thread::id _groupOwner;
+#endif
+#endif
+
+#ifdef ThreadSafe
+#if ThreadSafe == StdMutex
+  // Signaled when a consumer commits, for the writers blocked by ConsumerPolicy::Block.
+  std::condition_variable_any _commitSignal;
+#endif
+#endif
+
+  /// Token bucket of a source of lines.
+  struct SourceBucket
+  {
+    // Elements per second, 0 if the source is not limited
+    uint32_t rate = 0;
+    // Maximum count of elements written at once
+    uint32_t burst = 0;
+    // Available elements, in millionths
+    uint64_t tokens = 0;
+    // Time of the last refill
+    uint64_t refilledAt = 0;
+    // Count of dropped lines
+    uint32_t dropped = 0;
+    // Count of dropped lines not reported by a summary line yet
+    uint32_t unreported = 0;
+    // Time of the first dropped line not reported yet
+    uint64_t droppedAt = 0;
+  };
+
+  // Maximum length of the summary of the dropped lines
+  static const uint16_t DropSummaryLength = 48;
+  // Microseconds after the first unreported drop, when any accepted line writes the summary of the source
+  static const uint32_t DropSummaryDelay = 1000000;
+  // Token buckets of the sources
+  SourceBucket _sources[MaxSources];
 
-  // Index of the last line
-  int16_t _indexLastLine = -1;
+  // Observers of the buffer events, nullptr if the slot is free.
+  FlexibleCircularBufferObserver<BuffT> *_observers[MaxObservers] = {};
 
 #ifdef DebugMode_FlexibleCircularBuffer
 
@@ -380,21 +1602,21 @@ private:
 
   bool cellExistInLine(uint16_t cell, BufferLineMarker &line)
   {
-    if (line.startIndex < line.endIndex)
+    if (line.startIndex <= line.endIndex)
       return line.startIndex <= cell && cell <= line.endIndex;
     return cell <= line.endIndex || line.startIndex <= cell;
   }
 
   BufferLineMarker *GetLineByCell(uint16_t cell)
   {
-    if (_indexLastLine < 0)
+    if (_state->indexLastLine < 0)
       return nullptr;
 
-    for (int16_t index = _indexFirstLine; true; index = getNextIndex(index))
+    for (int16_t index = _state->indexFirstLine; true; index = getNextIndex(index))
     {
       if (cellExistInLine(cell, lines[index]))
         return &lines[index];
-      if (index == _indexLastLine)
+      if (index == _state->indexLastLine)
         break;
     }
 
@@ -434,7 +1656,9 @@ private:
         file << " color-" << currentLine->id % 10;
       }
       file << "\"><span>";
-      outBuffT(file, buff[i]);
+      // Cells outside of the lines hold no constructed element.
+      if (currentLine != nullptr || std::is_trivially_copyable<BuffT>::value)
+        outBuffT(file, buff[i]);
       file << "</span></td>\n";
     }
 
@@ -471,12 +1695,12 @@ private:
     for (uint16_t i = 0; i < _maxLines; i++)
     {
       bool isActiveLine = false;
-      if (_indexLastLine >= 0)
+      if (_state->indexLastLine >= 0)
       {
-        if (_indexFirstLine <= _indexLastLine)
-          isActiveLine = i <= _indexLastLine && i >= _indexFirstLine;
+        if (_state->indexFirstLine <= _state->indexLastLine)
+          isActiveLine = i <= _state->indexLastLine && i >= _state->indexFirstLine;
         else
-          isActiveLine = i <= _indexLastLine || _indexFirstLine <= i;
+          isActiveLine = i <= _state->indexLastLine || _state->indexFirstLine <= i;
       }
 
       uint16_t length = 0;
@@ -507,7 +1731,7 @@ private:
 
   /// @brief Get the next index in the text buffer.
   /// @param[in] index The current index.
-  int16_t getNextIndex(int16_t index)
+  int16_t getNextIndex(int16_t index) const
   {
     // Return the next index in the buffer.
     return (index + 1) % _maxLines;
@@ -515,83 +1739,960 @@ private:
 
   /// @brief Get the previous index in the text buffer.
   /// @param[in] index The current index.
-  int16_t getPrevIndex(int16_t index)
+  int16_t getPrevIndex(int16_t index) const
   {
     // Return the previous index in the buffer.
     return (index + _maxLines - 1) % _maxLines;
   };
 
-  void FixIntersection(BufferLineMarker &newLine)
+  /// @brief Call OnLineWritten of the observers, unless the line belongs to the group being written (see CommitGroup).
+  void notifyWritten(int16_t index)
+  {
+    if (_groupOpen && (int32_t)(lines[index].id - _groupFromId) >= 0)
+      return;
+    for (uint8_t i = 0; i < MaxObservers; i++)
+      if (_observers[i] != nullptr)
+        _observers[i]->OnLineWritten(createLineView(index));
+  }
+
+  void notifyUpdated(int16_t index)
   {
-    BufferLineMarker *line = &lines[_indexFirstLine];
-    bool InIntersection = line->inIntersection(newLine);
-    while (InIntersection)
+    for (uint8_t i = 0; i < MaxObservers; i++)
+      if (_observers[i] != nullptr)
+        _observers[i]->OnLineUpdated(createLineView(index));
+  }
+
+  /// @brief Mark the start of a change of the lines for the readers that take no lock.
+  void beginChange()
+  {
+    _state->generation.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  /// @brief Mark the end of a change of the lines.
+  void endChange()
+  {
+    _state->generation.fetch_add(1, std::memory_order_release);
+  }
+
+#ifdef FlexibleCircularBuffer_RawDump
+
+  /// @brief write() all the data, retrying after partial writes and interrupts.
+  static bool writeAll(int fd, const void *data, size_t size)
+  {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    while (size > 0)
     {
-      _indexFirstLine = getNextIndex(_indexFirstLine);
-      line = &lines[_indexFirstLine];
-      InIntersection = line->inIntersection(newLine);
+      ssize_t written = write(fd, bytes, size);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0)
+        return false;
+      bytes += written;
+      size -= written;
     }
+    return true;
   }
 
-  uint16_t calculateLineLength(BufferLineMarker &line)
+#endif
+
+  /// @brief Get the count of lines in the buffer.
+  uint16_t getLineCount() const
   {
-    if (line.startIndex < line.endIndex)
-      return line.endIndex - line.startIndex + 1;
-    return _bufferSize - line.startIndex + line.endIndex + 1;
+    if (_state->indexFirstLine < 0)
+      return 0;
+    return (_state->indexLastLine - _state->indexFirstLine + _maxLines) % _maxLines + 1;
   }
 
-  BuffT *AllocLineData(BufferLineMarker &line, uint16_t &length)
+  /// @brief Find the marker index of the line with given id.
+  /// Ids of the lines are consecutive, so the index is calculated from the id of the first line.
+  /// @return index, or -1 if there is no such line
+  int16_t findIndex(uint32_t id) const
   {
-    length = calculateLineLength(line);
-    BuffT *lineData = (BuffT *)malloc(sizeof(BuffT) * length);
-    // If the line is not fragmented
-    if (line.startIndex < line.endIndex)
+    if (_state->indexFirstLine < 0)
+      return -1;
+    uint32_t offset = id - lines[_state->indexFirstLine].id;
+    if (offset >= getLineCount())
+      return -1;
+    return (_state->indexFirstLine + offset) % _maxLines;
+  }
+
+  /// @brief Find the marker index of the line with given id, if the line is visible to the readers.
+  /// @return index, or -1 if there is no such line or it belongs to the group being written
+  int16_t findVisibleIndex(uint32_t id) const
+  {
+    if (_groupOpen && (int32_t)(id - _groupFromId) >= 0)
+      return -1;
+    return findIndex(id);
+  }
+
+  /// @brief Get the marker index of the last line visible to the readers, the line before the group being written.
+  /// @return index, or -1 if no line is visible
+  int16_t lastVisibleIndex() const
+  {
+    if (!_groupOpen)
+      return _state->indexLastLine;
+    return findIndex(_groupFromId - 1);
+  }
+
+  /// @brief Get the elements and the lines from the oldest line not committed by all the consumers to the last line,
+  /// none if there are no consumers. The lines are contiguous, so only the positions of these two lines are needed.
+  void getOccupancy(uint16_t &cells, uint16_t &lineCount) const
+  {
+    cells = 0;
+    lineCount = 0;
+    if (_state->indexFirstLine < 0)
+      return;
+
+    bool consumed = false;
+    uint32_t pendingId = 0;
+    for (uint8_t i = 0; i < BufferRingState::MaxConsumers; i++)
+    {
+      const BufferConsumer &consumer = _state->consumers[i];
+      if (consumer.name[0] == '\0')
+        continue;
+      if (!consumed || (int32_t)(consumer.committedId + 1 - pendingId) < 0)
+        pendingId = consumer.committedId + 1;
+      consumed = true;
+    }
+
+    // Without consumers the occupancy would stay at the capacity once the buffer wrapped, and the pressure never ends.
+    if (!consumed)
+      return;
+
+    int16_t first = _state->indexFirstLine;
+    if ((int32_t)(pendingId - lines[first].id) > 0)
     {
-      memcpy(lineData, buff + line.startIndex, length * sizeof(BuffT));
-      return lineData;
+      first = findIndex(pendingId);
+      // All the lines are committed.
+      if (first < 0)
+        return;
     }
-    // Otherwise, create a new line from fragments.
-    memcpy(lineData, buff + line.startIndex, (_bufferSize - line.startIndex) * sizeof(BuffT));
-    memcpy(lineData + _bufferSize - line.startIndex, buff, (line.endIndex + 1) * sizeof(BuffT));
-    return lineData;
+    int16_t last = _state->indexLastLine;
+    lineCount = (last - first + _maxLines) % _maxLines + 1;
+    cells = (lines[last].endIndex - lines[first].startIndex + _bufferSize) % _bufferSize + 1;
   }
 
-  BufferLine<BuffT> *CreateBufferLine(int16_t index)
+  /// @brief Notify the observers when the occupancy crosses a watermark, see SetWatermarks.
+  void checkPressure()
   {
-    uint16_t length = 0;
-    BuffT *lineData = AllocLineData(lines[index], length);
-    return new EditableBufferLine<BuffT>(lineData, length, lines[index].id);
+    if (_watermarks.highCells == 0 && _watermarks.highLines == 0)
+      return;
+
+    uint16_t cells, lineCount;
+    getOccupancy(cells, lineCount);
+    bool pressure;
+    if (_underPressure)
+      pressure = !((_watermarks.highCells == 0 || cells <= _watermarks.lowCells) &&
+                   (_watermarks.highLines == 0 || lineCount <= _watermarks.lowLines));
+    else
+      pressure = (_watermarks.highCells != 0 && cells >= _watermarks.highCells) ||
+                 (_watermarks.highLines != 0 && lineCount >= _watermarks.highLines);
+    if (pressure == _underPressure)
+      return;
+
+    _underPressure = pressure;
+    for (uint8_t i = 0; i < MaxObservers; i++)
+      if (_observers[i] != nullptr)
+        _observers[i]->OnPressureChanged(pressure);
   }
 
-  // FreeRTOS Thread sync mutex.
-#ifdef ThreadSafe
-#if ThreadSafe == FreeRTOS
-  SemaphoreHandle_t sync_mutex = nullptr;
-#endif
-#endif
+  /// @brief Write a line to the pinned region, the buffer is locked by the caller.
+  /// @return position of the line in the region + 1, 0 if the region is full
+  template <typename SrcT>
+  uint16_t appendPinned(SrcT *data, uint16_t length, const LineWriteOptions &options)
+  {
+    if (_pinnedLineCount == _pinnedMaxLines || length > _pinnedBufferSize - _pinnedUsed)
+      return 0;
 
-  /// @brief Thread lock
-  bool sync_lock()
+    BufferLineMarker &line = _pinnedLines[_pinnedLineCount];
+    line = BufferLineMarker();
+    line.startIndex = _pinnedUsed;
+    line.endIndex = _pinnedUsed + length - 1;
+    line.id = _pinnedLineCount + 1;
+    line.timestamp = options.timestamp != 0 ? options.timestamp : FlexibleCircularBufferClock::Now();
+    copyCells(_pinnedBuff + _pinnedUsed, data, length);
+    _pinnedUsed += length;
+    return ++_pinnedLineCount;
+  }
+
+  BufferLineView<BuffT> createPinnedView(uint16_t position) const
   {
-#ifdef ThreadSafe
-#if ThreadSafe == FreeRTOS
-    return sync_mutex ? (xSemaphoreTake(sync_mutex, portMAX_DELAY) == pdTRUE) : false;
-#else
-    return true;
-#endif
-#endif
+    const BufferLineMarker &line = _pinnedLines[position];
+    BufferLineView<BuffT> view;
+    view.id = line.id;
+    view.timestamp = line.timestamp;
+    view.pinned = true;
+    view.first = _pinnedBuff + line.startIndex;
+    view.firstLength = line.endIndex - line.startIndex + 1;
+    return view;
   }
 
-  /// @brief Thread unlock
-  void sync_unlock()
+  /// @brief Destroy the pinned lines.
+  void clearPinned()
   {
-#ifdef ThreadSafe
-#if ThreadSafe == FreeRTOS
-    xSemaphoreGive(sync_mutex);
-#endif
-#endif
+    if constexpr (!std::is_trivially_destructible<BuffT>::value)
+    {
+      for (uint16_t i = 0; i < _pinnedUsed; i++)
+        _pinnedBuff[i].~BuffT();
+    }
+    _pinnedUsed = 0;
+    _pinnedLineCount = 0;
   }
-};
+
+  /// @brief Destroy the pinned lines and free the pinned region.
+  void releasePinned()
+  {
+    if (_pinnedBuff == nullptr)
+      return;
+    clearPinned();
+    std::pmr::memory_resource *resource = _resource != nullptr ? _resource : std::pmr::get_default_resource();
+    resource->deallocate(_pinnedBuff, sizeof(BuffT) * _pinnedBufferSize, alignof(BuffT));
+    resource->deallocate(_pinnedLines, sizeof(BufferLineMarker) * _pinnedMaxLines, alignof(BufferLineMarker));
+    _pinnedBuff = nullptr;
+    _pinnedLines = nullptr;
+  }
+
+  /// @brief Get the home slot of the key in the key index.
+  uint16_t hashKey(uint16_t key) const
+  {
+    return (uint16_t)((key * 2654435761u) >> 16) & _keyIndexMask;
+  }
+
+  /// @brief Find the key in the key index.
+  /// @return slot of the key, or the empty slot where it would be inserted
+  uint16_t findKeySlot(uint16_t key) const
+  {
+    uint16_t slot = hashKey(key);
+    while (_keyIndex[slot] >= 0 && lines[_keyIndex[slot]].key != key)
+      slot = (slot + 1) & _keyIndexMask;
+    return slot;
+  }
+
+  /// @brief Remove the key of the slot from the key index, the keys after it are moved back,
+  /// so the probing of the other keys does not stop at the freed slot.
+  void removeKeySlot(uint16_t slot)
+  {
+    if (_keyIndex[slot] < 0)
+      return;
+    uint16_t hole = slot;
+    for (uint16_t next = (hole + 1) & _keyIndexMask; _keyIndex[next] >= 0; next = (next + 1) & _keyIndexMask)
+    {
+      // The key can be moved to the hole if its home slot is not between the hole and its slot.
+      uint16_t home = hashKey(lines[_keyIndex[next]].key);
+      if (((next - home) & _keyIndexMask) >= ((next - hole) & _keyIndexMask))
+      {
+        _keyIndex[hole] = _keyIndex[next];
+        hole = next;
+      }
+    }
+    _keyIndex[hole] = -1;
+  }
+
+  /// @brief Make the line the latest line of its key, the previous latest line is superseded.
+  void supersede(int16_t index)
+  {
+    uint16_t slot = findKeySlot(lines[index].key);
+    if (_keyIndex[slot] >= 0)
+      lines[_keyIndex[slot]].flags |= BufferLineMarker::Superseded;
+    _keyIndex[slot] = index;
+  }
+
+  /// @brief Check if a group is being written by another writer, the writes of this writer wait for it.
+  bool isGroupOfOtherWriter() const
+  {
+    if (!_groupOpen)
+      return false;
+#ifdef ThreadSafe
+#if ThreadSafe == FreeRTOS
+    return _groupOwner != xTaskGetCurrentTaskHandle();
+#elif ThreadSafe == StdMutex
+    return _groupOwner != std::this_thread::get_id();
+#endif
+#endif
+    return false;
+  }
+
+  /// @brief Make the calling writer the writer of the group.
+  void setGroupOwner()
+  {
+#ifdef ThreadSafe
+#if ThreadSafe == FreeRTOS
+    _groupOwner = xTaskGetCurrentTaskHandle();
+#elif ThreadSafe == StdMutex
+    _groupOwner = std::this_thread::get_id();
+#endif
+#endif
+  }
+
+  BufferLineView<BuffT> createLineView(int16_t index) const
+  {
+    return ViewOfMarker(lines[index]);
+  }
+
+  /// @brief Copy (or move, if SrcT is not const) the data to the buffer, starting from the given cell.
+  /// The data is split into two fragments if it reaches the end of the buffer.
+  template <typename SrcT>
+  void copyIn(uint16_t startIndex, SrcT *data, uint16_t length)
+  {
+    uint16_t firstLength = length;
+    if (startIndex + length > _bufferSize)
+      firstLength = _bufferSize - startIndex;
+
+    copyCells(buff + startIndex, data, firstLength);
+    // If an element of the second fragment throws, the first fragment is destroyed too.
+    CellsRollback rollback{buff + startIndex, firstLength};
+    copyCells(buff, data + firstLength, length - firstLength);
+    rollback.count = 0;
+  }
+
+  /// @brief Construct the elements in the raw cells. If a constructor throws, the elements constructed
+  /// before it are destroyed, so the cells are raw memory again.
+  template <typename SrcT>
+  static void copyCells(BuffT *to, SrcT *from, uint16_t count)
+  {
+    if constexpr (std::is_trivially_copyable<BuffT>::value)
+      memcpy(to, from, count * sizeof(BuffT));
+    else
+    {
+      CellsRollback rollback{to, 0};
+      for (; rollback.count < count; rollback.count++)
+      {
+        if constexpr (std::is_const<SrcT>::value)
+          new (to + rollback.count) BuffT(from[rollback.count]);
+        else
+          new (to + rollback.count) BuffT(std::move(from[rollback.count]));
+      }
+      rollback.count = 0;
+    }
+  }
+
+  /// @brief Assign the data to the elements of a line, starting from the given cell.
+  /// If an assignment throws, the line keeps a part of the old data, but all its elements stay constructed.
+  void assignIn(uint16_t startIndex, const BuffT *data, uint16_t length)
+  {
+    if constexpr (std::is_trivially_copyable<BuffT>::value)
+      copyIn(startIndex, data, length);
+    else
+    {
+      for (uint16_t i = 0, cell = startIndex; i < length; i++)
+      {
+        buff[cell] = data[i];
+        cell = cell + 1 == _bufferSize ? 0 : cell + 1;
+      }
+    }
+  }
+
+  /// @brief Destroys the first count elements of the cells at the end of the scope, unless count is set to 0.
+  /// Used to undo a partial construction when a constructor throws.
+  struct CellsRollback
+  {
+    BuffT *cells;
+    uint16_t count;
+
+    ~CellsRollback()
+    {
+      for (uint16_t i = 0; i < count; i++)
+        cells[i].~BuffT();
+    }
+  };
+
+  /// @brief Destroy the elements of the line, the cells become raw memory again.
+  void destroyLine(const BufferLineMarker &line)
+  {
+    if constexpr (!std::is_trivially_destructible<BuffT>::value)
+    {
+      for (uint16_t i = 0, cell = line.startIndex, length = calculateLineLength(line); i < length; i++)
+      {
+        buff[cell].~BuffT();
+        cell = cell + 1 == _bufferSize ? 0 : cell + 1;
+      }
+    }
+  }
+
+  /// @brief Remove the first line from the buffer.
+  void evictFirstLine()
+  {
+    bool stale = lines[_state->indexFirstLine].isStale(FlexibleCircularBufferClock::Now());
+    for (uint8_t i = 0; i < MaxObservers; i++)
+      if (_observers[i] != nullptr)
+      {
+        BufferLineView<BuffT> line = createLineView(_state->indexFirstLine);
+        line.stale = stale;
+        _observers[i]->OnLineEvicted(line);
+      }
+
+    // Only the lines of ConsumerPolicy::Evict consumers can be evicted before they are committed.
+    // A stale line was never readable by the consumer, so it is skipped but not lost.
+    uint32_t id = lines[_state->indexFirstLine].id;
+    for (uint8_t i = 0; i < BufferRingState::MaxConsumers; i++)
+    {
+      BufferConsumer &consumer = _state->consumers[i];
+      if (consumer.name[0] != '\0' && (int32_t)(id - consumer.committedId) > 0)
+      {
+        if (!stale)
+          consumer.lost++;
+        consumer.committedId = id;
+      }
+    }
+
+    destroyLine(lines[_state->indexFirstLine]);
+
+    // The key index points to the latest line of each key only.
+    const BufferLineMarker &first = lines[_state->indexFirstLine];
+    if (_keyIndex != nullptr && first.key != 0 && (first.flags & BufferLineMarker::Superseded) == 0)
+      removeKeySlot(findKeySlot(first.key));
+
+    if (_state->indexFirstLine == _state->indexLastLine)
+    {
+      _state->indexFirstLine = -1;
+      _state->indexLastLine = -1;
+    }
+    else
+      _state->indexFirstLine = getNextIndex(_state->indexFirstLine);
+  }
+
+  /// @brief Remove the first line and the rest of its group.
+  /// The last line is never removed with the group, it may be the one being extended by WriteToLastLine.
+  void evictFirstGroup()
+  {
+    evictFirstLine();
+    while (_state->indexFirstLine != -1 && _state->indexFirstLine != _state->indexLastLine &&
+           (lines[_state->indexFirstLine].flags & BufferLineMarker::GroupContinued) != 0)
+      evictFirstLine();
+  }
+
+  /// @brief Create a new line after the last one.
+  template <typename SrcT>
+  uint32_t appendLine(SrcT *data, uint16_t length, const LineWriteOptions &options)
+  {
+    // If the length of the data is 0, return 0.
+    if (length == 0)
+      return 0;
+
+    // for the correct operation of the algorithm, there must always be at least two active lines in the buffer.
+    // therefore, we check that the new lines data does not occupy more than half of the buffer.
+    if (length > _bufferSize / 2)
+      return 0;
+
+    SyncGuard lock(*this);
+
+    // The lines of a group are consecutive, so the other writers wait until it is committed.
+    while (isGroupOfOtherWriter())
+      waitCommit();
+
+    uint32_t id = 0;
+    if (_deduplicate && isRepeatOfLastLine(data, length, options))
+    {
+      BufferLineMarker &lastLine = lines[_state->indexLastLine];
+      {
+        ChangeGuard change(*this);
+        if (lastLine.repeatCount != UINT32_MAX)
+          lastLine.repeatCount++;
+      }
+      id = lastLine.id;
+      // The observers see the new repeat count.
+      notifyUpdated(_state->indexLastLine);
+    }
+    else if (admit(options.sourceId, length))
+    {
+      writeDropSummaries(options.sourceId);
+      id = appendLocked(data, length, options);
+    }
+
+    return id;
+  }
+
+  /// @brief Create a new line after the last one, the buffer is locked by the caller.
+  template <typename SrcT>
+  uint32_t appendLocked(SrcT *data, uint16_t length, const LineWriteOptions &options)
+  {
+    int16_t nextIndex;
+    BufferLineMarker newLine;
+    bool takesMarker;
+    for (bool wait = false;; wait = false)
+    {
+      // Another writer may have started a group while this one was waiting for a consumer,
+      // so the group is checked again before the position and the flags of the line are calculated.
+      while (isGroupOfOtherWriter())
+        waitCommit();
+
+      // The expired and superseded lines at the head are free space.
+      reclaimStale(FlexibleCircularBufferClock::Now());
+
+      // Get the next index to write to.
+      nextIndex = getNextIndex(_state->indexLastLine);
+
+      // If this is the first line, then it starts at the beginning of the buffer.
+      if (_state->indexLastLine == -1)
+      {
+        newLine.startIndex = 0;
+        newLine.id = _state->nextId;
+      }
+      else
+      {
+        // Otherwise, the new line starts right after the last line.
+        newLine.startIndex = (lines[_state->indexLastLine].endIndex + 1) % _bufferSize;
+        newLine.id = lines[_state->indexLastLine].id + 1;
+      }
+      // if the data does not fit into the end of the buffer, the line is fragmented.
+      newLine.endIndex = (newLine.startIndex + length - 1) % _bufferSize;
+      newLine.timestamp = options.timestamp != 0 ? options.timestamp : FlexibleCircularBufferClock::Now();
+      newLine.repeatCount = options.repeatCount;
+      newLine.ttl = options.ttl;
+      newLine.key = options.key;
+      newLine.sourceId = options.sourceId;
+      newLine.flags = _groupOpen && newLine.id != _groupFromId ? BufferLineMarker::GroupContinued : 0;
+
+      // if all markers are in use, the marker of the first line is taken by the new line.
+      takesMarker = _state->indexFirstLine != -1 && nextIndex == _state->indexFirstLine;
+
+      if (canOverwrite(newLine, takesMarker, &wait))
+        break;
+      // The lines may have changed while waiting, so the position is calculated again.
+      if (!wait)
+        return 0;
+      if (!waitCommit())
+      {
+        _rejectedWrites++;
+        return 0;
+      }
+    }
+
+    {
+      // If an element constructor throws, the evicted lines stay evicted and the new line is not added.
+      ChangeGuard change(*this);
+
+      if (takesMarker)
+        evictFirstGroup();
+
+      // if the data of the line we are recording intersects with the previously recorded lines,
+      // then we erase the overwritten lines before writing the data over them.
+      FixIntersection(newLine);
+
+      copyIn(newLine.startIndex, data, length);
+
+      // Set the new line as the last line. The marker is written before the positions, so a process that dies
+      // in between (SharedFlexibleCircularBuffer) leaves no position on an old marker.
+      lines[nextIndex] = newLine;
+      if (_state->indexFirstLine == -1)
+        _state->indexFirstLine = nextIndex;
+      _state->indexLastLine = nextIndex;
+      _state->nextId = newLine.id + 1;
+      if (_keyIndex != nullptr && newLine.key != 0)
+        supersede(_state->indexLastLine);
+    }
+    notifyWritten(_state->indexLastLine);
+    checkPressure();
+
+    // Return the id of the new line.
+    return newLine.id;
+  }
+
+  /// @brief Get the first line that has not expired or was superseded, starting from the given index.
+  /// @return index, or -1 if all the lines up to the last visible one are stale
+  int16_t skipStale(int16_t index, uint64_t now) const
+  {
+    int16_t last = lastVisibleIndex();
+    if (last < 0)
+      return -1;
+    while (index >= 0 && lines[index].isStale(now))
+      index = index == last ? -1 : getNextIndex(index);
+    return index;
+  }
+
+  /// @brief Evict the expired and superseded lines at the head of the buffer, so their markers and cells are free.
+  /// The held lines are kept.
+  void reclaimStale(uint64_t now)
+  {
+    if (!isFirstReclaimable(now))
+      return;
+    ChangeGuard change(*this);
+    do
+      evictFirstGroup();
+    while (isFirstReclaimable(now));
+  }
+
+  /// @brief Check if the first line is stale and can be evicted, see reclaimStale.
+  bool isFirstReclaimable(uint64_t now) const
+  {
+    return _state->indexFirstLine != -1 && lines[_state->indexFirstLine].isStale(now) &&
+           protectionOf(lines[_state->indexFirstLine].id) == LineProtection::None;
+  }
+
+  /// @brief Take the tokens of the line from the bucket of its source.
+  /// @return false if the source has not enough tokens, the write is dropped
+  bool admit(uint8_t sourceId, uint16_t length)
+  {
+    if (sourceId >= MaxSources || _sources[sourceId].rate == 0)
+      return true;
+
+    // The tokens are counted in millionths of an element, so the refill needs no division.
+    SourceBucket &source = _sources[sourceId];
+    uint64_t now = FlexibleCircularBufferClock::Now();
+    uint64_t elapsed = FlexibleCircularBufferClock::TicksToMicros(now - source.refilledAt);
+    uint64_t capacity = (uint64_t)source.burst * 1000000;
+    source.tokens += elapsed < 1000000000 ? elapsed * source.rate : capacity;
+    if (source.tokens > capacity)
+      source.tokens = capacity;
+    source.refilledAt = now;
+
+    uint64_t cost = (uint64_t)length * 1000000;
+    if (source.tokens < cost)
+    {
+      source.dropped++;
+      if (source.unreported++ == 0)
+        source.droppedAt = now;
+      return false;
+    }
+    source.tokens -= cost;
+    return true;
+  }
+
+  /// @brief Write the summary of the dropped lines of the source before its next line,
+  /// and the summaries of the other sources whose drops are older than DropSummaryDelay, they may not write again.
+  void writeDropSummaries(uint8_t sourceId)
+  {
+    uint64_t now = FlexibleCircularBufferClock::Now();
+    for (uint8_t other = 0; other < MaxSources; other++)
+      if (other == sourceId || (_sources[other].unreported != 0 &&
+                                now - _sources[other].droppedAt >= FlexibleCircularBufferClock::MicrosToTicks(DropSummaryDelay)))
+        writeDropSummary(other);
+  }
+
+  /// @brief Write the summary of the dropped lines of the source.
+  void writeDropSummary(uint8_t sourceId)
+  {
+    if (sourceId >= MaxSources || _sources[sourceId].unreported == 0)
+      return;
+
+    uint16_t length = 0;
+    if constexpr (std::is_trivial<BuffT>::value)
+    {
+      BuffT summary[DropSummaryLength];
+      length = formatDropSummary(sourceId, _sources[sourceId].unreported, summary);
+      if (length > 0 && appendLocked(static_cast<const BuffT *>(summary), length, LineWriteOptions()) == 0)
+        return;
+    }
+    _sources[sourceId].unreported = 0;
+  }
+
+  /// @brief Format the summary of the dropped lines, only text has summaries (FlexibleCircularBuffer.cpp).
+  /// @return length of the summary, 0 if there is no summary
+  uint16_t formatDropSummary([[maybe_unused]] uint8_t sourceId, [[maybe_unused]] uint32_t count, [[maybe_unused]] BuffT *to)
+  {
+    return 0;
+  }
+
+  /// @brief Check if the data and the options (key, ttl, source) are equal to those of the last line.
+  bool isRepeatOfLastLine(const BuffT *data, uint16_t length, const LineWriteOptions &options) const
+  {
+    if constexpr (std::is_trivially_copyable<BuffT>::value)
+    {
+      if (_state->indexLastLine == -1)
+        return false;
+      const BufferLineMarker &lastLine = lines[_state->indexLastLine];
+      if (lastLine.isStale(FlexibleCircularBufferClock::Now()) || lastLine.key != options.key || lastLine.ttl != options.ttl ||
+          lastLine.sourceId != options.sourceId)
+        return false;
+      BufferLineView<BuffT> last = createLineView(_state->indexLastLine);
+      return last.GetLength() == length &&
+             memcmp(last.first, data, sizeof(BuffT) * last.firstLength) == 0 &&
+             memcmp(last.second == nullptr ? data : last.second, data + last.firstLength, sizeof(BuffT) * last.secondLength) == 0;
+    }
+    return false;
+  }
+
+  /// @brief Find the active hold of the owner, or a free slot if active is false.
+  LineHold *findHold(const void *owner, bool active = true)
+  {
+    for (uint8_t i = 0; i < MaxHolds; i++)
+      if (_holds[i].active == active && (!active || _holds[i].owner == owner))
+        return &_holds[i];
+    return nullptr;
+  }
+
+  /// @brief Check if the line with the given id is held by an owner.
+  bool isHeld(uint32_t id) const
+  {
+    for (uint8_t i = 0; i < MaxHolds; i++)
+      if (_holds[i].active && (int32_t)(id - _holds[i].fromId) >= 0)
+        return true;
+    return false;
+  }
+
+  /// @brief Why a line cannot be overwritten.
+  enum class LineProtection : uint8_t
+  {
+    None,
+    /// Not committed by a ConsumerPolicy::Block consumer
+    Wait,
+    /// Held, or not committed by a ConsumerPolicy::Reject consumer
+    Reject
+  };
+
+  /// @brief Check if the line with the given id is held or kept for a consumer.
+  LineProtection protectionOf(uint32_t id) const
+  {
+    if (isHeld(id))
+      return LineProtection::Reject;
+
+    LineProtection ret = LineProtection::None;
+    for (uint8_t i = 0; i < BufferRingState::MaxConsumers; i++)
+    {
+      const BufferConsumer &consumer = _state->consumers[i];
+      if (consumer.name[0] == '\0' || consumer.policy == ConsumerPolicy::Evict || (int32_t)(id - consumer.committedId) <= 0)
+        continue;
+      if (consumer.policy == ConsumerPolicy::Reject)
+        return LineProtection::Reject;
+      ret = LineProtection::Wait;
+    }
+    return ret;
+  }
+
+  /// @brief Check that the lines the given line would overwrite are not held or kept for a consumer.
+  /// @param line the new (or grown) line
+  /// @param takesMarker true if the marker of the first line is taken by the new line
+  /// @param wait set to true if the write can wait for a consumer, nullptr to reject such a write
+  bool canOverwrite(const BufferLineMarker &line, bool takesMarker, bool *wait = nullptr)
+  {
+    if (_state->indexFirstLine == -1)
+      return true;
+
+    // The overwritten lines are always the oldest ones, so only the newest of them is checked.
+    int16_t index = _state->indexFirstLine;
+    int16_t newestOverwritten = -1;
+    if (takesMarker)
+    {
+      newestOverwritten = index;
+      index = index == _state->indexLastLine ? -1 : getNextIndex(index);
+    }
+    while (index != -1 && index != _state->indexLastLine && lines[index].inIntersection(line))
+    {
+      newestOverwritten = index;
+      index = getNextIndex(index);
+    }
+
+    if (newestOverwritten == -1)
+      return true;
+
+    // A group is evicted as a unit, so the rest of the group of the newest overwritten line is overwritten too.
+    while (newestOverwritten != _state->indexLastLine &&
+           (lines[getNextIndex(newestOverwritten)].flags & BufferLineMarker::GroupContinued) != 0)
+      newestOverwritten = getNextIndex(newestOverwritten);
+
+    // The group being written cannot overwrite its own first line.
+    if (_groupOpen && (int32_t)(lines[newestOverwritten].id - _groupFromId) >= 0)
+    {
+      _rejectedWrites++;
+      return false;
+    }
+
+    LineProtection protection = protectionOf(lines[newestOverwritten].id);
+    if (protection == LineProtection::None)
+      return true;
+
+    // The lock of an external state is held by the caller while waiting, so the consumers of other processes
+    // could never commit: a ConsumerPolicy::Block consumer found in such a state rejects the write.
+    if (protection == LineProtection::Wait && wait != nullptr && _state == &_ownState)
+      *wait = true;
+    else
+      _rejectedWrites++;
+    return false;
+  }
+
+  /// @brief Find the consumer with given name.
+  /// @return consumer, or nullptr if not found
+  BufferConsumer *findConsumer(const char *name)
+  {
+    for (uint8_t i = 0; i < BufferRingState::MaxConsumers; i++)
+      if (strncmp(_state->consumers[i].name, name, BufferConsumer::MaxNameLength) == 0)
+        return &_state->consumers[i];
+    return nullptr;
+  }
+
+  /// @brief Wait until a consumer commits, the buffer is unlocked while waiting.
+  /// @return false if the buffer has no lock, so there is nobody to wait for
+  bool waitCommit()
+  {
+#ifdef ThreadSafe
+#if ThreadSafe == FreeRTOS
+    sync_unlock();
+    vTaskDelay(1);
+    sync_lock();
+    return true;
+#elif ThreadSafe == StdMutex
+    // The commits and the groups of this object signal the condition, the caller checks the lines again
+    // after every wake up, so the timeout only bounds a wait that missed a change.
+    _commitSignal.wait_for(sync_mutex, std::chrono::milliseconds(10));
+    return true;
+#endif
+#endif
+    return false;
+  }
+
+  /// @brief Wake up the writers waiting for a commit.
+  void notifyCommit()
+  {
+#ifdef ThreadSafe
+#if ThreadSafe == StdMutex
+    _commitSignal.notify_all();
+#endif
+#endif
+  }
+
+  /// @brief Evict the oldest lines (with their groups) that intersect with the given line.
+  /// The last line is never evicted, it is the one being extended by WriteToLastLine.
+  void FixIntersection(const BufferLineMarker &newLine)
+  {
+    while (_state->indexFirstLine != -1 && _state->indexFirstLine != _state->indexLastLine &&
+           lines[_state->indexFirstLine].inIntersection(newLine))
+      evictFirstGroup();
+  }
+
+  uint16_t calculateLineLength(const BufferLineMarker &line) const
+  {
+    if (line.startIndex <= line.endIndex)
+      return line.endIndex - line.startIndex + 1;
+    return _bufferSize - line.startIndex + line.endIndex + 1;
+  }
+
+  BuffT *AllocLineData(BufferLineMarker &line, uint16_t &length)
+  {
+    length = calculateLineLength(line);
+    BuffT *lineData;
+    if constexpr (alignof(BuffT) > alignof(std::max_align_t))
+      lineData = (BuffT *)aligned_alloc(alignof(BuffT), sizeof(BuffT) * length);
+    else
+      lineData = (BuffT *)malloc(sizeof(BuffT) * length);
+    // The copy is freed if an element constructor throws.
+    std::unique_ptr<BuffT, void (*)(void *)> owner(lineData, free);
+
+    // If the line is not fragmented
+    if (line.startIndex <= line.endIndex)
+      copyCells(lineData, static_cast<const BuffT *>(buff + line.startIndex), length);
+    else
+    {
+      // Otherwise, create a new line from fragments.
+      uint16_t firstLength = _bufferSize - line.startIndex;
+      copyCells(lineData, static_cast<const BuffT *>(buff + line.startIndex), firstLength);
+      CellsRollback rollback{lineData, firstLength};
+      copyCells(lineData + firstLength, static_cast<const BuffT *>(buff), line.endIndex + 1);
+      rollback.count = 0;
+    }
+    return owner.release();
+  }
+
+  BufferLine<BuffT> *CreateBufferLine(int16_t index)
+  {
+    uint16_t length = 0;
+    BuffT *lineData = AllocLineData(lines[index], length);
+    std::unique_ptr<BuffT, void (*)(void *)> owner(lineData, free);
+    CellsRollback rollback{lineData, length};
+    BufferLine<BuffT> *ret = new EditableBufferLine<BuffT>(lineData, length, lines[index].id, lines[index].timestamp, lines[index].repeatCount);
+    rollback.count = 0;
+    owner.release();
+    return ret;
+  }
+
+  // Thread sync mutex.
+#ifdef ThreadSafe
+#if ThreadSafe == FreeRTOS
+  SemaphoreHandle_t sync_mutex = nullptr;
+#elif ThreadSafe == StdMutex
+  std::mutex sync_mutex;
+#endif
+#endif
+
+  /// @brief Create the thread sync mutex
+  void sync_init()
+  {
+#ifdef ThreadSafe
+#if ThreadSafe == FreeRTOS
+    sync_mutex = xSemaphoreCreateMutex();
+#endif
+#endif
+  }
+
+  /// @brief Thread lock
+  bool sync_lock()
+  {
+#ifdef ThreadSafe
+#if ThreadSafe == FreeRTOS
+    return sync_mutex ? (xSemaphoreTake(sync_mutex, portMAX_DELAY) == pdTRUE) : false;
+#elif ThreadSafe == StdMutex
+    sync_mutex.lock();
+#endif
+#endif
+    return true;
+  }
+
+  /// @brief Thread unlock
+  void sync_unlock()
+  {
+#ifdef ThreadSafe
+#if ThreadSafe == FreeRTOS
+    xSemaphoreGive(sync_mutex);
+#elif ThreadSafe == StdMutex
+    sync_mutex.unlock();
+#endif
+#endif
+  }
+
+  /// @brief Holds the thread lock until the end of the scope, so an exception of an element constructor,
+  /// a visitor or an observer does not leave the buffer locked.
+  class SyncGuard
+  {
+  public:
+    explicit SyncGuard(FlexibleCircularBuffer &buffer)
+        : _buffer(buffer)
+    {
+      _buffer.sync_lock();
+    }
+
+    ~SyncGuard()
+    {
+      _buffer.sync_unlock();
+    }
+
+    SyncGuard(const SyncGuard &) = delete;
+    SyncGuard &operator=(const SyncGuard &) = delete;
+
+  private:
+    FlexibleCircularBuffer &_buffer;
+  };
+
+  /// @brief Marks a change of the lines from the constructor to the end of the scope (beginChange, endChange),
+  /// so the generation is even again even if an element constructor throws.
+  class ChangeGuard
+  {
+  public:
+    explicit ChangeGuard(FlexibleCircularBuffer &buffer)
+        : _buffer(buffer)
+    {
+      _buffer.beginChange();
+    }
+
+    ~ChangeGuard()
+    {
+      _buffer.endChange();
+    }
+
+    ChangeGuard(const ChangeGuard &) = delete;
+    ChangeGuard &operator=(const ChangeGuard &) = delete;
+
+  private:
+    FlexibleCircularBuffer &_buffer;
+  };
+};
+
+/// @brief For text the terminating \0 of the last line is replaced by the appended data (FlexibleCircularBuffer.cpp).
+template <>
+uint32_t FlexibleCircularBuffer<char>::WriteToLastLine(uint32_t id, const char *data, uint16_t length);
+
+/// @brief For text the dropped lines are reported by a summary line (FlexibleCircularBuffer.cpp).
+template <>
+uint16_t FlexibleCircularBuffer<char>::formatDropSummary(uint8_t sourceId, uint32_t count, char *to);
 
 #ifdef DebugMode_FlexibleCircularBuffer
 
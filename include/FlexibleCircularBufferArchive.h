@@ -0,0 +1,474 @@
+#pragma once
+
+#ifndef FlexibleCircularBufferArchive_h
+#define FlexibleCircularBufferArchive_h
+
+#include "FlexibleCircularBuffer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <dirent.h>
+#include <vector>
+
+/// @brief Header of a line in a segment file, followed by length elements.
+struct ArchiveRecordHeader
+{
+public:
+  /// Identifier of the line
+  uint32_t id;
+  /// Count of elements
+  uint16_t length;
+  /// Flags of the record, 0 in the archives written before the flags existed
+  uint16_t flags;
+  /// Time of the write, in microseconds since the Unix epoch with WallClock,
+  /// in ticks of FlexibleCircularBufferClock since the boot without it
+  uint64_t timestamp;
+
+  /// Flag of a record with a wall clock timestamp.
+  static const uint16_t WallClock = 1;
+};
+
+/// @brief Line read from the archive. The data is valid only inside the visitor it was passed to.
+/// @tparam BuffT Type of the buffer.
+template <typename BuffT>
+struct ArchivedLine
+{
+public:
+  /// Identifier of the line
+  uint32_t id;
+  /// Time of the write, in microseconds since the Unix epoch, see ArchiveRecordHeader::timestamp
+  uint64_t timestamp;
+  /// Data
+  const BuffT *data;
+  /// Count of elements
+  uint16_t length;
+};
+
+/// @brief On-disk archive fed by the buffer, so the history can go beyond the memory.
+/// The lines are appended to segment files of a fixed size; when the total size exceeds the quota, the oldest
+/// segments are deleted. A sparse index (one entry per indexInterval bytes) maps ids and timestamps to file offsets,
+/// so a read seeks close to the line instead of scanning the archive.
+/// The timestamps are stored as wall clock time, so they stay in order across reboots: the system time must be set
+/// (SNTP, RTC) before the lines are pumped. A line is never archived with a time before the previous line, so a step
+/// of the system time back stamps the following lines with the time of the last archived line until the clock catches up.
+/// The archived ids keep growing across reboots: the first Pump after Open continues the ids of an empty buffer,
+/// and the lines of a buffer that restarted its ids start a new epoch, archived with ids that follow the last archived id.
+/// @tparam BuffT Type of the buffer, must be trivially copyable.
+template <typename BuffT>
+class FlexibleCircularBufferArchive
+{
+  static_assert(std::is_trivially_copyable<BuffT>::value, "Only trivially copyable types can be archived");
+
+public:
+  /// @brief Constructor.
+  /// @param directory existing directory of the segment files, used only by this archive
+  /// @param segmentSize maximum size of a segment file in bytes
+  /// @param quota maximum total size of the segment files in bytes
+  /// @param indexInterval bytes between the sparse index entries
+  FlexibleCircularBufferArchive(const char *directory, uint32_t segmentSize = 64 * 1024, uint32_t quota = 1024 * 1024,
+                                uint32_t indexInterval = 4096)
+      : _segmentSize(segmentSize),
+        _quota(quota),
+        _indexInterval(indexInterval)
+  {
+    snprintf(_directory, sizeof(_directory), "%s", directory);
+  }
+
+  ~FlexibleCircularBufferArchive()
+  {
+    Close();
+  }
+
+  FlexibleCircularBufferArchive(const FlexibleCircularBufferArchive &) = delete;
+  FlexibleCircularBufferArchive &operator=(const FlexibleCircularBufferArchive &) = delete;
+
+  /// @brief Open the archive: the existing segments are scanned to rebuild the index.
+  /// @return false if the directory cannot be read
+  bool Open()
+  {
+    Close();
+
+    DIR *dir = opendir(_directory);
+    if (dir == nullptr)
+      return false;
+    while (dirent *entry = readdir(dir))
+    {
+      unsigned long firstId;
+      char tail;
+      if (sscanf(entry->d_name, "seg-%10lu.log%c", &firstId, &tail) == 1)
+        _segments.push_back({(uint32_t)firstId, 0});
+    }
+    closedir(dir);
+
+    std::sort(_segments.begin(), _segments.end(), [](const Segment &a, const Segment &b)
+              { return a.firstId < b.firstId; });
+    for (Segment &segment : _segments)
+      scanSegment(segment);
+    _continueIds = true;
+    return true;
+  }
+
+  /// @brief Close the current segment file.
+  void Close()
+  {
+    if (_file != nullptr)
+      fclose(_file);
+    _file = nullptr;
+    _segments.clear();
+    _index.clear();
+    _totalSize = 0;
+    _lastId = 0;
+    _lastTimestamp = 0;
+    _idBase = 0;
+    _continueIds = false;
+  }
+
+  /// @brief Append the lines of the buffer that are not archived yet.
+  /// The buffer is locked only while the lines are copied, not during the file writes.
+  /// The first call after Open sets the next id of an empty buffer after the last archived id (see SetNextId).
+  /// @param buffer buffer
+  /// @return count of archived lines
+  uint32_t Pump(FlexibleCircularBuffer<BuffT> &buffer)
+  {
+    uint32_t count = 0;
+    // The timestamps of the buffer count from the boot, they are moved to the wall clock.
+    int64_t bootTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count() -
+                       (int64_t)FlexibleCircularBufferMicros();
+    if (_continueIds && _lastId != 0)
+      buffer.SetNextId(_lastId + 1);
+    _continueIds = false;
+
+    uint32_t firstId, lastId;
+    uint64_t lastTimestamp = _lastTimestamp;
+    while (buffer.GetIdRange(firstId, lastId))
+    {
+      // A buffer behind the archive was restarted (after a reboot) and counts its ids from 1 again.
+      if ((int32_t)(lastId + _idBase - _lastId) < 0)
+        _idBase = _lastId;
+      // Id of the last archived line in the ids of the buffer
+      uint32_t archivedId = _lastId - _idBase;
+      if ((int32_t)(lastId - archivedId) <= 0)
+        break;
+
+      uint32_t nextId = archivedId + 1;
+      if (_lastId == 0 || (int32_t)(firstId - nextId) > 0)
+      {
+        if (_lastId != 0)
+          _linesLost += firstId - nextId;
+        nextId = firstId;
+      }
+
+      _staging.clear();
+      uint32_t scannedId = nextId - 1;
+      uint16_t visited = buffer.VisitLines(nextId, [&](const BufferLineView<BuffT> &line)
+                                           {
+                                             size_t offset = _staging.size();
+                                             _staging.resize(offset + sizeof(ArchiveRecordHeader) + line.GetLength() * sizeof(BuffT));
+                                             lastTimestamp = std::max(lastTimestamp, (uint64_t)(bootTime + (int64_t)FlexibleCircularBufferClock::ToMicros(line.timestamp)));
+                                             ArchiveRecordHeader header = {line.id + _idBase, line.GetLength(), ArchiveRecordHeader::WallClock, lastTimestamp};
+                                             memcpy(_staging.data() + offset, &header, sizeof(header));
+                                             line.CopyTo(reinterpret_cast<BuffT *>(_staging.data() + offset + sizeof(header)), 0, line.GetLength());
+                                             return _staging.size() < _indexInterval; },
+                                           scannedId);
+
+      // The rest of the lines have expired or were superseded, they are not archived.
+      if (visited == 0)
+      {
+        if ((int32_t)(scannedId - nextId) < 0)
+          break;
+        _lastId = scannedId + _idBase;
+        continue;
+      }
+
+      for (size_t offset = 0; offset < _staging.size();)
+      {
+        ArchiveRecordHeader header;
+        memcpy(&header, _staging.data() + offset, sizeof(header));
+        size_t size = sizeof(header) + header.length * sizeof(BuffT);
+        if (!append(header, _staging.data() + offset, size))
+          return count;
+        offset += size;
+        count++;
+      }
+    }
+
+    if (_file != nullptr)
+      fflush(_file);
+    return count;
+  }
+
+  /// @brief Pass the archived lines to the visitor in order, starting from the line with given id
+  /// (or from the oldest archived line, if that line was deleted).
+  /// @param fromId id of the first line to visit
+  /// @param visitor callable with (const ArchivedLine<BuffT> &), returns false to stop
+  /// @return count of visited lines
+  template <typename Visitor>
+  uint32_t ReadFrom(uint32_t fromId, Visitor &&visitor)
+  {
+    // The last index entry at or before the line.
+    auto entry = std::upper_bound(_index.begin(), _index.end(), fromId, [](uint32_t id, const IndexEntry &entry)
+                                  { return (int32_t)(id - entry.id) < 0; });
+    if (entry != _index.begin())
+      entry--;
+    return readFrom(entry, fromId, 0, visitor);
+  }
+
+  /// @brief Pass the archived lines written at or after the given time to the visitor in order.
+  /// The index is searched by time, which relies on the archived timestamps growing with the ids (Pump keeps them monotonic).
+  /// The lines of the archives written before the wall clock timestamps (see ArchiveRecordHeader::flags) are not found by time.
+  /// @param timestamp time in microseconds since the Unix epoch
+  /// @param visitor callable with (const ArchivedLine<BuffT> &), returns false to stop
+  /// @return count of visited lines
+  template <typename Visitor>
+  uint32_t ReadFromTime(uint64_t timestamp, Visitor &&visitor)
+  {
+    auto entry = std::upper_bound(_index.begin(), _index.end(), timestamp, [](uint64_t timestamp, const IndexEntry &entry)
+                                  { return timestamp < entry.timestamp; });
+    if (entry != _index.begin())
+      entry--;
+    return entry == _index.end() ? 0 : readFrom(entry, entry->id, timestamp, visitor);
+  }
+
+  /// @brief Get the id of the newest archived line (or of a newer line skipped by Pump because it has expired), 0 if the archive is empty.
+  uint32_t GetLastId() const
+  {
+    return _lastId;
+  }
+
+  /// @brief Get the count of lines overwritten in the buffer before they were archived.
+  uint32_t GetLinesLost() const
+  {
+    return _linesLost;
+  }
+
+private:
+  struct Segment
+  {
+    /// Id of the first line, also the name of the file
+    uint32_t firstId;
+    /// Size of the file
+    uint32_t size;
+  };
+
+  struct IndexEntry
+  {
+    /// Id of the line
+    uint32_t id;
+    /// Time of the line
+    uint64_t timestamp;
+    /// Id of the first line of the segment
+    uint32_t segmentId;
+    /// Offset of the line in the segment
+    uint32_t offset;
+  };
+
+  // Directory of the segment files
+  char _directory[128];
+  // Maximum size of a segment
+  const uint32_t _segmentSize;
+  // Maximum total size
+  const uint32_t _quota;
+  // Bytes between index entries
+  const uint32_t _indexInterval;
+  // Segments, oldest first
+  std::vector<Segment> _segments;
+  // Sparse index, oldest first
+  std::vector<IndexEntry> _index;
+  // Current segment file, opened for appending
+  FILE *_file = nullptr;
+  // Total size of the segments
+  uint64_t _totalSize = 0;
+  // Offset of the last index entry in the current segment
+  uint32_t _lastIndexedOffset = 0;
+  // Id of the newest archived or skipped line
+  uint32_t _lastId = 0;
+  // Timestamp of the newest archived line
+  uint64_t _lastTimestamp = 0;
+  // Added to the ids of the buffer in the current epoch, the ids of the buffer restart from 1 after a reboot
+  uint32_t _idBase = 0;
+  // Set by Open, the next Pump continues the ids of an empty buffer
+  bool _continueIds = false;
+  // Lines overwritten before they were archived
+  uint32_t _linesLost = 0;
+  // Encoded lines, copied from the buffer
+  std::vector<uint8_t> _staging;
+
+  void segmentPath(char *path, size_t size, uint32_t firstId) const
+  {
+    snprintf(path, size, "%s/seg-%010lu.log", _directory, (unsigned long)firstId);
+  }
+
+  /// @brief Read the record headers of the segment to rebuild its index entries.
+  void scanSegment(Segment &segment)
+  {
+    char path[160];
+    segmentPath(path, sizeof(path), segment.firstId);
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr)
+      return;
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    ArchiveRecordHeader header;
+    uint32_t offset = 0;
+    uint32_t lastIndexed = 0;
+    while (fread(&header, sizeof(header), 1, file) == 1)
+    {
+      uint32_t size = sizeof(header) + header.length * sizeof(BuffT);
+      // A record cut by a crash is dropped, the next append overwrites it.
+      if (offset + size > (unsigned long)fileSize)
+        break;
+      if (offset == 0 || offset - lastIndexed >= _indexInterval)
+      {
+        // A record without a wall clock timestamp is older than all the others, its time is not comparable.
+        _index.push_back({header.id, (header.flags & ArchiveRecordHeader::WallClock) != 0 ? header.timestamp : 0, segment.firstId, offset});
+        lastIndexed = offset;
+      }
+      if (fseek(file, header.length * sizeof(BuffT), SEEK_CUR) != 0)
+        break;
+      offset += size;
+      _lastId = header.id;
+      if ((header.flags & ArchiveRecordHeader::WallClock) != 0)
+        _lastTimestamp = header.timestamp;
+    }
+    fclose(file);
+
+    segment.size = offset;
+    _totalSize += offset;
+    _lastIndexedOffset = lastIndexed;
+  }
+
+  /// @brief Append the encoded record to the current segment, rotating it when it is full.
+  bool append(const ArchiveRecordHeader &header, const uint8_t *record, size_t size)
+  {
+    if (_segments.empty() || _segments.back().size + size > _segmentSize)
+    {
+      if (!rotate(header.id))
+        return false;
+    }
+    else if (_file == nullptr && !reopen())
+      return false;
+
+    Segment &segment = _segments.back();
+    if (fwrite(record, size, 1, _file) != 1)
+      return false;
+
+    if (segment.size == 0 || segment.size - _lastIndexedOffset >= _indexInterval)
+    {
+      _index.push_back({header.id, header.timestamp, segment.firstId, segment.size});
+      _lastIndexedOffset = segment.size;
+    }
+    segment.size += size;
+    _totalSize += size;
+    _lastId = header.id;
+    _lastTimestamp = header.timestamp;
+
+    deleteOverQuota();
+    return true;
+  }
+
+  /// @brief Open the last segment for appending, after its last complete record.
+  bool reopen()
+  {
+    char path[160];
+    segmentPath(path, sizeof(path), _segments.back().firstId);
+    if (truncate(path, _segments.back().size) != 0)
+      return false;
+    _file = fopen(path, "r+b");
+    return _file != nullptr && fseek(_file, _segments.back().size, SEEK_SET) == 0;
+  }
+
+  /// @brief Start a new segment with the given line.
+  bool rotate(uint32_t firstId)
+  {
+    if (_file != nullptr)
+      fclose(_file);
+
+    char path[160];
+    segmentPath(path, sizeof(path), firstId);
+    _file = fopen(path, "wb");
+    if (_file == nullptr)
+      return false;
+
+    _segments.push_back({firstId, 0});
+    _lastIndexedOffset = 0;
+    return true;
+  }
+
+  /// @brief Delete the oldest segments while the total size exceeds the quota. The current segment is kept.
+  void deleteOverQuota()
+  {
+    while (_totalSize > _quota && _segments.size() > 1)
+    {
+      char path[160];
+      segmentPath(path, sizeof(path), _segments.front().firstId);
+      remove(path);
+      _totalSize -= _segments.front().size;
+
+      uint32_t segmentId = _segments.front().firstId;
+      _index.erase(_index.begin(), std::find_if(_index.begin(), _index.end(), [&](const IndexEntry &entry)
+                                                { return entry.segmentId != segmentId; }));
+      _segments.erase(_segments.begin());
+    }
+  }
+
+  /// @brief Read the lines starting from the index entry, skipping the lines before fromId or fromTimestamp.
+  template <typename Iterator, typename Visitor>
+  uint32_t readFrom(Iterator entry, uint32_t fromId, uint64_t fromTimestamp, Visitor &visitor)
+  {
+    if (entry == _index.end())
+      return 0;
+
+    if (_file != nullptr)
+      fflush(_file);
+
+    uint32_t count = 0;
+    std::vector<BuffT> data;
+    auto segment = std::find_if(_segments.begin(), _segments.end(), [&](const Segment &segment)
+                                { return segment.firstId == entry->segmentId; });
+    uint32_t offset = entry->offset;
+
+    for (; segment != _segments.end(); segment++, offset = 0)
+    {
+      char path[160];
+      segmentPath(path, sizeof(path), segment->firstId);
+      FILE *file = fopen(path, "rb");
+      if (file == nullptr || fseek(file, offset, SEEK_SET) != 0)
+      {
+        if (file != nullptr)
+          fclose(file);
+        continue;
+      }
+
+      ArchiveRecordHeader header;
+      for (; offset < segment->size && fread(&header, sizeof(header), 1, file) == 1;
+           offset += sizeof(header) + header.length * sizeof(BuffT))
+      {
+        // Skip the lines before the requested one.
+        if ((int32_t)(header.id - fromId) < 0 ||
+            (fromTimestamp != 0 && ((header.flags & ArchiveRecordHeader::WallClock) == 0 || header.timestamp < fromTimestamp)))
+        {
+          fseek(file, header.length * sizeof(BuffT), SEEK_CUR);
+          continue;
+        }
+
+        data.resize(header.length);
+        if (fread(data.data(), sizeof(BuffT), header.length, file) != header.length)
+          break;
+
+        count++;
+        if (!visitor(ArchivedLine<BuffT>{header.id, header.timestamp, data.data(), header.length}))
+        {
+          fclose(file);
+          return count;
+        }
+      }
+      fclose(file);
+    }
+    return count;
+  }
+};
+
+#endif
@@ -0,0 +1,493 @@
+#pragma once
+
+#ifndef FlexibleCircularBufferDrainer_h
+#define FlexibleCircularBufferDrainer_h
+
+#include "FlexibleCircularBuffer.h"
+
+#include <atomic>
+#include <cerrno>
+#include <unistd.h>
+
+#if ThreadSafe == FreeRTOS
+#include <freertos/task.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+/// @brief Destination of the drained lines.
+/// @tparam BuffT Type of the buffer.
+template <typename BuffT>
+class DrainerSink
+{
+public:
+  virtual ~DrainerSink() = default;
+
+  /// @brief Write a batch of lines.
+  /// @param data formatted lines
+  /// @param length count of elements
+  /// @return false if the batch was not written
+  virtual bool Write(const BuffT *data, size_t length) = 0;
+
+  /// @brief Write everything that the sink buffers itself.
+  virtual void Flush()
+  {
+  }
+};
+
+/// @brief Sink that writes the batches to a file descriptor: a file, a pipe or a local socket.
+/// @tparam BuffT Type of the buffer.
+template <typename BuffT>
+class FileDescriptorSink : public DrainerSink<BuffT>
+{
+public:
+  explicit FileDescriptorSink(int fd)
+      : _fd(fd)
+  {
+  }
+
+  bool Write(const BuffT *data, size_t length) override
+  {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+    size_t size = length * sizeof(BuffT);
+    while (size > 0)
+    {
+      ssize_t written = write(_fd, bytes, size);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0)
+        return false;
+      bytes += written;
+      size -= written;
+    }
+    return true;
+  }
+
+  void Flush() override
+  {
+    fsync(_fd);
+  }
+
+private:
+  // File descriptor
+  const int _fd;
+};
+
+/// @brief Sink that passes the batches to a function.
+/// @tparam BuffT Type of the buffer.
+template <typename BuffT>
+class CallbackSink : public DrainerSink<BuffT>
+{
+public:
+  typedef bool (*Callback)(void *context, const BuffT *data, size_t length);
+
+  CallbackSink(Callback callback, void *context = nullptr)
+      : _callback(callback),
+        _context(context)
+  {
+  }
+
+  bool Write(const BuffT *data, size_t length) override
+  {
+    return _callback(_context, data, length);
+  }
+
+private:
+  // Function that receives the batches
+  const Callback _callback;
+  // First argument of the callback
+  void *const _context;
+};
+
+/// @brief Statistics of the drainer.
+struct DrainerMetrics
+{
+public:
+  /// Count of lines passed to the sink
+  uint32_t linesDrained = 0;
+  /// Count of elements passed to the sink
+  uint64_t elementsDrained = 0;
+  /// Count of batches passed to the sink
+  uint32_t batches = 0;
+  /// Count of lines that were overwritten before they were drained, or did not fit into a batch
+  uint32_t linesLost = 0;
+  /// Count of batches the sink failed to write
+  uint32_t sinkErrors = 0;
+  /// Count of lines written to the buffer and not drained yet
+  uint32_t backlog = 0;
+  /// Time from the write that woke the drainer to the end of the drain, of the last drain
+  uint32_t lastLatencyUs = 0;
+  /// Maximum of lastLatencyUs
+  uint32_t maxLatencyUs = 0;
+};
+
+/// @brief Drains the lines of the buffer to a sink on its own thread (FreeRTOS task).
+/// It wakes up when a line is written or when the interval expires, copies all the available lines
+/// to a batch and passes the batch to the sink with one call.
+/// @tparam BuffT Type of the buffer.
+template <typename BuffT>
+class FlexibleCircularBufferDrainer : public FlexibleCircularBufferObserver<BuffT>
+{
+public:
+  /// @brief Format a line into the batch.
+  /// @param line line
+  /// @param to destination in the batch
+  /// @param capacity free space in the batch
+  /// @return count of written elements, 0 if the line does not fit
+  typedef uint16_t (*LineFormatter)(const BufferLineView<BuffT> &line, BuffT *to, size_t capacity);
+
+  /// @brief Constructor.
+  /// @param buffer buffer to drain
+  /// @param sink destination of the lines
+  /// @param batchSize count of elements in a batch, must be larger than the longest formatted line
+  /// @param intervalMs maximum time between drains, when no line is written
+  FlexibleCircularBufferDrainer(FlexibleCircularBuffer<BuffT> &buffer, DrainerSink<BuffT> &sink,
+                                size_t batchSize = 4096, uint32_t intervalMs = 1000)
+      : _buffer(buffer),
+        _sink(sink),
+        _batchSize(batchSize),
+        _intervalMs(intervalMs)
+  {
+    _batch = new BuffT[_batchSize];
+#if ThreadSafe == FreeRTOS
+    _drainMutex = xSemaphoreCreateMutex();
+    _stopped = xSemaphoreCreateBinary();
+#endif
+  }
+
+  ~FlexibleCircularBufferDrainer()
+  {
+    Stop();
+    delete[] _batch;
+#if ThreadSafe == FreeRTOS
+    vSemaphoreDelete(_drainMutex);
+    vSemaphoreDelete(_stopped);
+#endif
+  }
+
+  FlexibleCircularBufferDrainer(const FlexibleCircularBufferDrainer &) = delete;
+  FlexibleCircularBufferDrainer &operator=(const FlexibleCircularBufferDrainer &) = delete;
+
+  /// @brief Set the function that formats a line into the batch, by default the line is copied as is.
+  /// Call it before Start.
+  void SetFormatter(LineFormatter formatter)
+  {
+    _formatter = formatter;
+  }
+
+  /// @brief Commit the drained lines as a consumer of the buffer (see FlexibleCircularBuffer::AddConsumer),
+  /// so the watermarks of the buffer measure the lines not drained yet (see FlexibleCircularBuffer::SetWatermarks).
+  /// A batch the sink fails to write is not committed, it is drained again. Call it before Start.
+  /// @param name name of the consumer, shorter than BufferConsumer::MaxNameLength
+  /// @param policy what the writer does with the lines not drained yet, by default they are overwritten
+  /// @return false if the consumer was not added
+  bool SetConsumer(const char *name, ConsumerPolicy policy = ConsumerPolicy::Evict)
+  {
+    if (_running || !_buffer.AddConsumer(name, policy))
+      return false;
+    strcpy(_consumer, name);
+    return true;
+  }
+
+  /// @brief Start the drainer thread. Only the lines written after the start are drained,
+  /// or the lines after the last commit of the consumer (SetConsumer).
+  /// @param name name of the task
+  /// @param stackSize stack size of the task (FreeRTOS only)
+  /// @param priority priority of the task (FreeRTOS only)
+  /// @return false if already started, the thread was not created or the buffer has FlexibleCircularBuffer::MaxObservers observers
+  bool Start([[maybe_unused]] const char *name = "fcb-drainer", [[maybe_unused]] uint32_t stackSize = 4096, [[maybe_unused]] uint32_t priority = 1)
+  {
+    if (_running)
+      return false;
+
+    uint32_t firstId, lastId, committedId;
+    _nextId = _buffer.GetIdRange(firstId, lastId) ? lastId + 1 : 1;
+    if (_consumer[0] != '\0' && _buffer.GetConsumerOffset(_consumer, committedId))
+      _nextId = committedId + 1;
+    _running = true;
+
+#if ThreadSafe == FreeRTOS
+    if (xTaskCreate(taskEntry, name, stackSize, this, priority, &_task) != pdPASS)
+    {
+      _running = false;
+      return false;
+    }
+#else
+    _thread = std::thread(&FlexibleCircularBufferDrainer::run, this);
+#endif
+
+    // Without an observer slot the drainer would only wake up by its interval.
+    if (!_buffer.AddObserver(this))
+    {
+      Stop();
+      return false;
+    }
+    return true;
+  }
+
+  /// @brief Stop the drainer thread, the remaining lines are drained before return.
+  void Stop()
+  {
+    if (!_running)
+      return;
+
+    _buffer.RemoveObserver(this);
+    _running = false;
+
+#if ThreadSafe == FreeRTOS
+    xTaskNotifyGive(_task);
+    xSemaphoreTake(_stopped, portMAX_DELAY);
+#else
+    wakeUp();
+    _thread.join();
+#endif
+
+    Flush();
+  }
+
+  /// @brief Drain all the available lines on the calling thread and flush the sink, for example at shutdown.
+  void Flush()
+  {
+    drainLock();
+    drain();
+    drainUnlock();
+    _sink.Flush();
+  }
+
+  /// @brief Get the statistics of the drainer.
+  DrainerMetrics GetMetrics()
+  {
+    drainLock();
+    DrainerMetrics metrics = _metrics;
+    uint32_t firstId, lastId;
+    metrics.backlog = _buffer.GetIdRange(firstId, lastId) && (int32_t)(lastId - _nextId) >= 0 ? lastId - _nextId + 1 : 0;
+    drainUnlock();
+    return metrics;
+  }
+
+  void OnLineWritten(const BufferLineView<BuffT> &line) override
+  {
+    // The pinned lines are not drained.
+    if (line.pinned)
+      return;
+    // Only the first write after a drain wakes the thread up. The flag and the time are one atomic,
+    // so a drain cannot clear the flag and leave the time of a drained write for the next batch.
+    uint32_t expected = 0;
+    if (!_pendingSince.compare_exchange_strong(expected, (uint32_t)FlexibleCircularBufferMicros() | 1, std::memory_order_acq_rel))
+      return;
+    wakeUp();
+  }
+
+private:
+  // Drained buffer
+  FlexibleCircularBuffer<BuffT> &_buffer;
+  // Destination of the lines
+  DrainerSink<BuffT> &_sink;
+  // Lines formatted for the sink
+  BuffT *_batch;
+  // Count of elements in the batch
+  const size_t _batchSize;
+  // Maximum time between drains
+  const uint32_t _intervalMs;
+  // Function that formats a line into the batch
+  LineFormatter _formatter = copyLine;
+  // Name of the consumer committed after each batch, empty if none
+  char _consumer[BufferConsumer::MaxNameLength] = {};
+  // Id of the next line to drain
+  uint32_t _nextId = 1;
+  // Statistics
+  DrainerMetrics _metrics;
+  // Set while the thread runs
+  std::atomic<bool> _running{false};
+  // Time of the first write not drained yet (lower 32 bits of the microseconds, never 0), 0 if none
+  std::atomic<uint32_t> _pendingSince{0};
+
+#if ThreadSafe == FreeRTOS
+  // Drainer task
+  TaskHandle_t _task = nullptr;
+  // Serializes the drains of the task and Flush
+  SemaphoreHandle_t _drainMutex = nullptr;
+  // Given by the task when it exits
+  SemaphoreHandle_t _stopped = nullptr;
+
+  static void taskEntry(void *drainer)
+  {
+    static_cast<FlexibleCircularBufferDrainer *>(drainer)->run();
+    xSemaphoreGive(static_cast<FlexibleCircularBufferDrainer *>(drainer)->_stopped);
+    vTaskDelete(nullptr);
+  }
+
+  void wakeUp()
+  {
+    xTaskNotifyGive(_task);
+  }
+
+  void waitWakeUp()
+  {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(_intervalMs));
+  }
+
+  void drainLock()
+  {
+    xSemaphoreTake(_drainMutex, portMAX_DELAY);
+  }
+
+  void drainUnlock()
+  {
+    xSemaphoreGive(_drainMutex);
+  }
+#else
+  // Drainer thread
+  std::thread _thread;
+  // Serializes the drains of the thread and Flush
+  std::mutex _drainMutex;
+  // Guards the wake up condition
+  std::mutex _wakeUpMutex;
+  // Signaled on new lines and on stop
+  std::condition_variable _wakeUp;
+
+  void wakeUp()
+  {
+    // Taking the mutex makes sure the thread is either waiting or will see the flag.
+    {
+      std::lock_guard<std::mutex> lock(_wakeUpMutex);
+    }
+    _wakeUp.notify_one();
+  }
+
+  void waitWakeUp()
+  {
+    std::unique_lock<std::mutex> lock(_wakeUpMutex);
+    _wakeUp.wait_for(lock, std::chrono::milliseconds(_intervalMs), [this]
+                     { return _pendingSince.load() != 0 || !_running.load(); });
+  }
+
+  void drainLock()
+  {
+    _drainMutex.lock();
+  }
+
+  void drainUnlock()
+  {
+    _drainMutex.unlock();
+  }
+#endif
+
+  void run()
+  {
+    while (_running)
+    {
+      waitWakeUp();
+      drainLock();
+      drain();
+      drainUnlock();
+    }
+  }
+
+  /// @brief Pass all the available lines to the sink, in batches.
+  void drain()
+  {
+    uint32_t pendingSince = _pendingSince.exchange(0);
+
+    uint32_t firstId, lastId;
+    while (_buffer.GetIdRange(firstId, lastId) && (int32_t)(lastId - _nextId) >= 0)
+    {
+      // The lines older than the first line were overwritten before they were drained.
+      if ((int32_t)(firstId - _nextId) > 0)
+      {
+        _metrics.linesLost += firstId - _nextId;
+        _nextId = firstId;
+      }
+
+      size_t length = 0;
+      uint32_t lines = 0;
+      uint32_t skipped = 0;
+      uint32_t batchFromId = _nextId;
+      uint32_t scannedId = _nextId - 1;
+      uint16_t visited = _buffer.VisitLines(_nextId, [&](const BufferLineView<BuffT> &line)
+                                            {
+                                              uint16_t formatted = _formatter(line, _batch + length, _batchSize - length);
+                                              if (formatted == 0 && length > 0)
+                                                return false;
+                                              // A line that does not fit into the empty batch is skipped.
+                                              if (formatted == 0)
+                                                skipped++;
+                                              else
+                                                lines++;
+                                              length += formatted;
+                                              _nextId = line.id + 1;
+                                              return true; },
+                                            scannedId);
+
+      // The rest of the lines have expired or were superseded, they are not drained.
+      if (visited == 0)
+      {
+        if ((int32_t)(scannedId - _nextId) < 0)
+          break;
+        _nextId = scannedId + 1;
+      }
+
+      if (length == 0)
+      {
+        _metrics.linesLost += skipped;
+        continue;
+      }
+
+      if (!_sink.Write(_batch, length))
+      {
+        // The batch is drained again after the interval: the lines are committed only once they are written,
+        // so a consumer that keeps its lines (Reject, Block) loses none. The latency is measured by that drain.
+        _metrics.sinkErrors++;
+        _nextId = batchFromId;
+        pendingSince = 0;
+        break;
+      }
+      _metrics.linesDrained += lines;
+      _metrics.linesLost += skipped;
+      _metrics.elementsDrained += length;
+      _metrics.batches++;
+      commit();
+    }
+    commit();
+
+    if (pendingSince != 0)
+    {
+      _metrics.lastLatencyUs = (uint32_t)FlexibleCircularBufferMicros() - pendingSince;
+      if (_metrics.lastLatencyUs > _metrics.maxLatencyUs)
+        _metrics.maxLatencyUs = _metrics.lastLatencyUs;
+    }
+  }
+
+  /// @brief Commit the lines before the next line to drain.
+  void commit()
+  {
+    if (_consumer[0] != '\0')
+      _buffer.CommitConsumer(_consumer, _nextId - 1);
+  }
+
+  /// @brief Default formatter, copies the line as is.
+  static uint16_t copyLine(const BufferLineView<BuffT> &line, BuffT *to, size_t capacity)
+  {
+    if (line.GetLength() > capacity)
+      return 0;
+    line.CopyTo(to, 0, line.GetLength());
+    return line.GetLength();
+  }
+};
+
+/// @brief Formatter for text lines: the line is copied and its \0 terminator is replaced by \n.
+inline uint16_t TextLineFormatter(const BufferLineView<char> &line, char *to, size_t capacity)
+{
+  uint16_t length = line.GetLength();
+  if (length > 0 && line[length - 1] == '\0')
+    length--;
+  if (length + 1u > capacity)
+    return 0;
+  line.CopyTo(to, 0, length);
+  to[length] = '\n';
+  return length + 1;
+}
+
+#endif
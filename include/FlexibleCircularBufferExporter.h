@@ -0,0 +1,619 @@
+#pragma once
+
+#ifndef FlexibleCircularBufferExporter_h
+#define FlexibleCircularBufferExporter_h
+
+#include "FlexibleCircularBuffer.h"
+
+// The exporter runs on host builds only: it needs std::thread, pwrite and, for io_uring, Linux.
+#ifndef ESP_PLATFORM
+
+#include <cerrno>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define FlexibleCircularBuffer_IoUring
+#endif
+
+/// @brief One write of the export: a part of a line, or a line separator.
+struct ExportWrite
+{
+public:
+  /// Data to write
+  const void *data;
+  /// Size in bytes
+  size_t size;
+  /// Offset in the file
+  off_t offset;
+  /// true if the data is inside the registered buffer memory
+  bool registered;
+};
+
+#ifdef FlexibleCircularBuffer_IoUring
+
+/// @brief Minimal io_uring submission and completion queues, over the raw system calls.
+class ExportUring
+{
+public:
+  /// @brief Create the queues.
+  /// @param entries count of submission queue entries
+  explicit ExportUring(unsigned entries)
+  {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    _fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (_fd < 0)
+      return;
+
+    _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+      _sqRingSize = _cqRingSize = _sqRingSize > _cqRingSize ? _sqRingSize : _cqRingSize;
+
+    _sqRing = mmap(nullptr, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    _cqRing = params.features & IORING_FEAT_SINGLE_MMAP
+                  ? _sqRing
+                  : mmap(nullptr, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+    _sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    _sqes = static_cast<io_uring_sqe *>(mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES));
+    if (_sqRing == MAP_FAILED || _cqRing == MAP_FAILED || _sqes == MAP_FAILED)
+    {
+      close();
+      return;
+    }
+
+    uint8_t *sq = static_cast<uint8_t *>(_sqRing);
+    _sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    _sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    _sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    _sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    _sqEntries = params.sq_entries;
+
+    uint8_t *cq = static_cast<uint8_t *>(_cqRing);
+    _cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    _cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    _cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    _cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+  }
+
+  ~ExportUring()
+  {
+    close();
+  }
+
+  /// @brief Check if io_uring is available.
+  bool IsOpen() const
+  {
+    return _fd >= 0;
+  }
+
+  /// @brief Get the count of submission queue entries.
+  unsigned GetEntries() const
+  {
+    return _sqEntries;
+  }
+
+  /// @brief Register the memory, so the writes from it do not map its pages again (IORING_OP_WRITE_FIXED).
+  bool RegisterBuffer(const void *data, size_t size)
+  {
+    iovec iov = {const_cast<void *>(data), size};
+    return syscall(__NR_io_uring_register, _fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+  }
+
+  /// @brief Queue a write, it is submitted by SubmitAndWait.
+  /// @return false if the submission queue is full
+  bool QueueWrite(int fd, const ExportWrite &write, uint64_t userData)
+  {
+    unsigned head = __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+    if (_localTail - head >= _sqEntries)
+      return false;
+
+    unsigned index = _localTail & _sqMask;
+    io_uring_sqe *sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write.registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(write.data);
+    sqe->len = write.size;
+    sqe->off = write.offset;
+    sqe->buf_index = 0;
+    sqe->user_data = userData;
+    _sqArray[index] = index;
+    _localTail++;
+    _queued++;
+    return true;
+  }
+
+  /// @brief Submit the queued writes and wait for all of them to complete.
+  /// @param completion callable with (uint64_t userData, int result)
+  /// @return false if io_uring_enter failed
+  template <typename Completion>
+  bool SubmitAndWait(Completion &&completion)
+  {
+    __atomic_store_n(_sqTail, _localTail, __ATOMIC_RELEASE);
+
+    unsigned toSubmit = _queued;
+    unsigned toComplete = _queued;
+    _queued = 0;
+
+    while (toComplete > 0)
+    {
+      int entered = syscall(__NR_io_uring_enter, _fd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (entered < 0 && errno != EINTR)
+        return false;
+      if (entered > 0)
+        toSubmit -= entered < (int)toSubmit ? entered : toSubmit;
+
+      unsigned head = *_cqHead;
+      unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+      for (; head != tail && toComplete > 0; head++, toComplete--)
+      {
+        io_uring_cqe &cqe = _cqes[head & _cqMask];
+        completion(cqe.user_data, cqe.res);
+      }
+      __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+    }
+    return true;
+  }
+
+private:
+  int _fd = -1;
+  void *_sqRing = MAP_FAILED;
+  void *_cqRing = MAP_FAILED;
+  io_uring_sqe *_sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+  size_t _sqRingSize = 0;
+  size_t _cqRingSize = 0;
+  size_t _sqesSize = 0;
+  unsigned *_sqHead = nullptr;
+  unsigned *_sqTail = nullptr;
+  unsigned *_sqArray = nullptr;
+  unsigned _sqMask = 0;
+  unsigned _sqEntries = 0;
+  unsigned *_cqHead = nullptr;
+  unsigned *_cqTail = nullptr;
+  unsigned _cqMask = 0;
+  io_uring_cqe *_cqes = nullptr;
+  // Tail of the submission queue, published by SubmitAndWait
+  unsigned _localTail = 0;
+  // Count of queued and not submitted writes
+  unsigned _queued = 0;
+
+  void close()
+  {
+    if (_sqes != MAP_FAILED)
+      munmap(_sqes, _sqesSize);
+    if (_cqRing != MAP_FAILED && _cqRing != _sqRing)
+      munmap(_cqRing, _cqRingSize);
+    if (_sqRing != MAP_FAILED)
+      munmap(_sqRing, _sqRingSize);
+    if (_fd >= 0)
+      ::close(_fd);
+    _fd = -1;
+  }
+};
+
+#endif
+
+/// @brief Statistics of the exporter.
+struct ExporterMetrics
+{
+public:
+  /// Count of lines written to the file
+  uint32_t linesExported = 0;
+  /// Count of bytes written to the file
+  uint64_t bytesExported = 0;
+  /// Count of batches
+  uint32_t batches = 0;
+  /// Count of lines overwritten before they were exported
+  uint32_t linesLost = 0;
+  /// Count of writes that failed
+  uint32_t writeErrors = 0;
+};
+
+/// @brief Exports the lines of the buffer to a file asynchronously, straight from the buffer memory.
+/// On Linux the writes are submitted to io_uring (the buffer memory is registered with it),
+/// elsewhere or if io_uring is not available they are done by a pool of threads.
+/// The exported lines are held (see FlexibleCircularBuffer::HoldLines) until their writes complete,
+/// so the writers fail instead of overwriting them.
+/// The writes complete in any order at their own offsets, so the file must not be opened with O_APPEND
+/// (Linux ignores the offsets of pwrite on such a file): Start fails for it. Host builds only.
+/// @tparam BuffT Type of the buffer, must be trivially copyable.
+template <typename BuffT>
+class FlexibleCircularBufferExporter : public FlexibleCircularBufferObserver<BuffT>
+{
+  static_assert(std::is_trivially_copyable<BuffT>::value, "Only trivially copyable types can be exported");
+
+public:
+  /// @brief Constructor.
+  /// @param buffer buffer to export
+  /// @param fd file descriptor, the lines are appended to its end
+  /// @param maxLinesInFlight maximum count of lines in one batch
+  /// @param intervalMs maximum time between batches, when no line is written
+  /// @param poolThreads count of threads, if io_uring is not available
+  FlexibleCircularBufferExporter(FlexibleCircularBuffer<BuffT> &buffer, int fd, uint16_t maxLinesInFlight = 64,
+                                 uint32_t intervalMs = 100, uint8_t poolThreads = 2)
+      : _buffer(buffer),
+        _fd(fd),
+        _maxLinesInFlight(maxLinesInFlight),
+        _intervalMs(intervalMs),
+        _poolThreads(poolThreads)
+#ifdef FlexibleCircularBuffer_IoUring
+        ,
+        _uring(maxLinesInFlight * 3)
+#endif
+  {
+    _writes.reserve(maxLinesInFlight * 3);
+#ifdef FlexibleCircularBuffer_IoUring
+    if (_uring.IsOpen())
+      _registered = _uring.RegisterBuffer(_buffer.GetStorage(), sizeof(BuffT) * _buffer.GetBufferSize());
+#endif
+  }
+
+  ~FlexibleCircularBufferExporter()
+  {
+    Stop();
+  }
+
+  FlexibleCircularBufferExporter(const FlexibleCircularBufferExporter &) = delete;
+  FlexibleCircularBufferExporter &operator=(const FlexibleCircularBufferExporter &) = delete;
+
+  /// @brief Write each line followed by the separator, for example "\n" for text.
+  /// @param separator separator, must stay valid while the exporter runs
+  /// @param size size of the separator in bytes
+  /// @param dropLastElement true to not write the last element of each line, for example the \0 of text
+  void SetSeparator(const void *separator, size_t size, bool dropLastElement)
+  {
+    _separator = separator;
+    _separatorSize = size;
+    _dropLastElement = dropLastElement;
+  }
+
+  /// @brief Check if the writes are submitted to io_uring.
+  bool UsesIoUring() const
+  {
+#ifdef FlexibleCircularBuffer_IoUring
+    return _uring.IsOpen();
+#else
+    return false;
+#endif
+  }
+
+  /// @brief Commit the exported lines as a consumer of the buffer (see FlexibleCircularBuffer::AddConsumer),
+  /// so the watermarks of the buffer measure the lines not exported yet (see FlexibleCircularBuffer::SetWatermarks).
+  /// A batch with a failed write is not committed, it is written again. Call it before Start.
+  /// @param name name of the consumer, shorter than BufferConsumer::MaxNameLength
+  /// @param policy what the writer does with the lines not exported yet, by default they are overwritten
+  /// @return false if the consumer was not added
+  bool SetConsumer(const char *name, ConsumerPolicy policy = ConsumerPolicy::Evict)
+  {
+    if (_running || !_buffer.AddConsumer(name, policy))
+      return false;
+    strcpy(_consumer, name);
+    return true;
+  }
+
+  /// @brief Start the export. Only the lines written after the start are exported,
+  /// or the lines after the last commit of the consumer (SetConsumer).
+  /// @return false if already started, the file is opened with O_APPEND or the buffer has FlexibleCircularBuffer::MaxObservers observers
+  bool Start()
+  {
+    int flags = fcntl(_fd, F_GETFL);
+    if (_running || flags < 0 || (flags & O_APPEND) != 0)
+      return false;
+
+    uint32_t firstId, lastId, committedId;
+    _nextId = _buffer.GetIdRange(firstId, lastId) ? lastId + 1 : 1;
+    if (_consumer[0] != '\0' && _buffer.GetConsumerOffset(_consumer, committedId))
+      _nextId = committedId + 1;
+    _offset = lseek(_fd, 0, SEEK_END);
+    if (_offset < 0)
+      _offset = 0;
+    _running = true;
+
+    _poolRunning = true;
+    if (!UsesIoUring())
+      for (uint8_t i = 0; i < _poolThreads; i++)
+        _pool.emplace_back(&FlexibleCircularBufferExporter::poolRun, this);
+    _thread = std::thread(&FlexibleCircularBufferExporter::run, this);
+
+    // Without an observer slot the exporter would only wake up by its interval.
+    if (!_buffer.AddObserver(this))
+    {
+      Stop();
+      return false;
+    }
+    return true;
+  }
+
+  /// @brief Stop the export, the remaining lines are exported before return.
+  void Stop()
+  {
+    if (!_running)
+      return;
+
+    _buffer.RemoveObserver(this);
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _running = false;
+    }
+    _wakeUp.notify_all();
+    _thread.join();
+
+    // The pool threads are stopped after the last batch of the export thread.
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _poolRunning = false;
+    }
+    _poolWakeUp.notify_all();
+    for (std::thread &thread : _pool)
+      thread.join();
+    _pool.clear();
+
+    while (exportBatch())
+      ;
+  }
+
+  /// @brief Get the statistics of the exporter.
+  ExporterMetrics GetMetrics()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _metrics;
+  }
+
+  void OnLineWritten(const BufferLineView<BuffT> &line) override
+  {
+    // The pinned lines are not exported.
+    if (line.pinned)
+      return;
+    if (_pending.exchange(true, std::memory_order_acq_rel))
+      return;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+    }
+    _wakeUp.notify_one();
+  }
+
+private:
+  FlexibleCircularBuffer<BuffT> &_buffer;
+  // Destination file
+  const int _fd;
+  // Maximum count of lines in one batch
+  const uint16_t _maxLinesInFlight;
+  // Maximum time between batches
+  const uint32_t _intervalMs;
+  // Count of pool threads
+  const uint8_t _poolThreads;
+  // Line separator
+  const void *_separator = nullptr;
+  size_t _separatorSize = 0;
+  bool _dropLastElement = false;
+  // Name of the consumer committed after each batch, empty if none
+  char _consumer[BufferConsumer::MaxNameLength] = {};
+  // Id of the next line to export
+  uint32_t _nextId = 1;
+  // Offset of the end of the file
+  off_t _offset = 0;
+  // Writes of the current batch
+  std::vector<ExportWrite> _writes;
+  ExporterMetrics _metrics;
+
+  std::atomic<bool> _running{false};
+  std::atomic<bool> _pending{false};
+  std::thread _thread;
+  // Guards the metrics, the wake up conditions and the pool state
+  std::mutex _mutex;
+  std::condition_variable _wakeUp;
+
+  // Pool threads, if io_uring is not available
+  std::vector<std::thread> _pool;
+  bool _poolRunning = false;
+  // Count of writes of the current batch given to the pool
+  size_t _poolCount = 0;
+  std::condition_variable _poolWakeUp;
+  std::condition_variable _poolDone;
+  // Index of the next write taken by a pool thread
+  size_t _poolNext = 0;
+  // Count of writes done by the pool in the current batch
+  size_t _poolCompleted = 0;
+  // Count of failed writes of the current batch
+  uint32_t _poolErrors = 0;
+
+#ifdef FlexibleCircularBuffer_IoUring
+  ExportUring _uring;
+  // true if the buffer memory is registered with io_uring
+  bool _registered = false;
+#endif
+
+  void run()
+  {
+    while (_running)
+    {
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _wakeUp.wait_for(lock, std::chrono::milliseconds(_intervalMs), [this]
+                         { return _pending.load() || !_running.load(); });
+      }
+      while (_running && exportBatch())
+        ;
+    }
+  }
+
+  /// @brief Write the next batch of lines.
+  /// @return true if there were lines to write
+  bool exportBatch()
+  {
+    _pending = false;
+
+    // Hold the lines before reading their positions, so the writes from the buffer memory stay valid.
+    // If other owners take all the holds, the batch waits for the next wake up.
+    if (!_buffer.HoldLines(_nextId, this))
+      return false;
+
+    // The lines older than the first line were overwritten before they were exported. The held lines are not evicted,
+    // so the lines skipped by the visit below have expired or were superseded, they are not lost.
+    uint32_t lost = 0;
+    uint32_t firstId, lastId;
+    if (_buffer.GetIdRange(firstId, lastId) && (int32_t)(firstId - _nextId) > 0)
+    {
+      lost = firstId - _nextId;
+      _nextId = firstId;
+    }
+    uint32_t batchFromId = _nextId;
+
+    _writes.clear();
+    uint16_t lines = 0;
+    off_t offset = _offset;
+    uint32_t scannedId = _nextId - 1;
+    _buffer.VisitLines(_nextId, [&](const BufferLineView<BuffT> &line)
+                       {
+                         uint16_t length = line.GetLength() - (_dropLastElement && line.GetLength() > 0 ? 1 : 0);
+                         uint16_t firstLength = length < line.firstLength ? length : line.firstLength;
+                         addWrite(line.first, firstLength * sizeof(BuffT), offset, true);
+                         addWrite(line.second, (length - firstLength) * sizeof(BuffT), offset, true);
+                         addWrite(_separator, _separatorSize, offset, false);
+                         _nextId = line.id + 1;
+                         return ++lines < _maxLinesInFlight; },
+                       scannedId);
+
+    if (lines == 0)
+    {
+      _buffer.ReleaseLines(this);
+      _nextId = scannedId + 1;
+      commit();
+      std::lock_guard<std::mutex> lock(_mutex);
+      _metrics.linesLost += lost;
+      return false;
+    }
+
+    uint32_t errors = UsesIoUring() ? writeUring() : writePool();
+
+    _buffer.ReleaseLines(this);
+    if (errors > 0)
+    {
+      // The batch is written again at the same offsets after the interval: the lines are committed only once
+      // they are written, so a consumer that keeps its lines (Reject, Block) loses none.
+      _nextId = batchFromId;
+      std::lock_guard<std::mutex> lock(_mutex);
+      _metrics.linesLost += lost;
+      _metrics.writeErrors += errors;
+      return false;
+    }
+    commit();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _metrics.linesLost += lost;
+    _metrics.linesExported += lines;
+    _metrics.bytesExported += offset - _offset;
+    _metrics.batches++;
+    _offset = offset;
+    return true;
+  }
+
+  /// @brief Commit the lines before the next line to export.
+  void commit()
+  {
+    if (_consumer[0] != '\0')
+      _buffer.CommitConsumer(_consumer, _nextId - 1);
+  }
+
+  void addWrite(const void *data, size_t size, off_t &offset, bool registered)
+  {
+    if (size == 0)
+      return;
+#ifdef FlexibleCircularBuffer_IoUring
+    registered = registered && _registered;
+#endif
+    _writes.push_back({data, size, offset, registered});
+    offset += size;
+  }
+
+  /// @brief Write the rest of a short write synchronously.
+  bool completeWrite(const ExportWrite &write, ssize_t written)
+  {
+    const uint8_t *data = static_cast<const uint8_t *>(write.data);
+    while (written >= 0 && (size_t)written < write.size)
+    {
+      ssize_t result = pwrite(_fd, data + written, write.size - written, write.offset + written);
+      if (result < 0 && errno == EINTR)
+        continue;
+      if (result <= 0)
+        return false;
+      written += result;
+    }
+    return written >= 0;
+  }
+
+  uint32_t writeUring()
+  {
+    uint32_t errors = 0;
+#ifdef FlexibleCircularBuffer_IoUring
+    for (size_t i = 0; i < _writes.size(); i++)
+    {
+      if (!_uring.QueueWrite(_fd, _writes[i], i))
+      {
+        // The queue is full, wait for the queued writes.
+        if (!_uring.SubmitAndWait([&](uint64_t index, int result)
+                                  { errors += !completeWrite(_writes[index], result); }))
+          errors++;
+        _uring.QueueWrite(_fd, _writes[i], i);
+      }
+    }
+    if (!_uring.SubmitAndWait([&](uint64_t index, int result)
+                              { errors += !completeWrite(_writes[index], result); }))
+      errors++;
+#endif
+    return errors;
+  }
+
+  uint32_t writePool()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _poolNext = 0;
+    _poolCompleted = 0;
+    _poolErrors = 0;
+    _poolCount = _writes.size();
+    _poolWakeUp.notify_all();
+    _poolDone.wait(lock, [this]
+                   { return _poolCompleted == _poolCount || _pool.empty(); });
+
+    // No pool threads (stopped), write on this thread.
+    for (; _poolNext < _poolCount; _poolNext++)
+      _poolErrors += !completeWrite(_writes[_poolNext], 0);
+    _poolCount = 0;
+    return _poolErrors;
+  }
+
+  void poolRun()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_poolRunning)
+    {
+      _poolWakeUp.wait(lock, [this]
+                       { return _poolNext < _poolCount || !_poolRunning; });
+      while (_poolNext < _poolCount)
+      {
+        const ExportWrite &write = _writes[_poolNext++];
+        lock.unlock();
+        bool written = completeWrite(write, 0);
+        lock.lock();
+        _poolErrors += !written;
+        if (++_poolCompleted == _poolCount)
+          _poolDone.notify_one();
+      }
+    }
+  }
+};
+
+#endif
+
+#endif
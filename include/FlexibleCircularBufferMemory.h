@@ -0,0 +1,185 @@
+#pragma once
+
+#ifndef FlexibleCircularBufferMemory_h
+#define FlexibleCircularBufferMemory_h
+
+#include <cstdint>
+#include <cstdlib>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#ifdef ESP_PLATFORM
+#include "esp_heap_caps.h"
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef ESP_PLATFORM
+
+/// @brief Memory resource that allocates from the ESP-IDF heap with the given capabilities.
+/// For example MALLOC_CAP_SPIRAM to place a large buffer in PSRAM, or MALLOC_CAP_DMA for DMA-capable memory:
+/// static HeapCapsMemoryResource psram(MALLOC_CAP_SPIRAM);
+/// static FlexibleCircularBuffer<char> logBuffer(32768, 512, &psram);
+class HeapCapsMemoryResource : public std::pmr::memory_resource
+{
+public:
+  explicit HeapCapsMemoryResource(uint32_t caps)
+      : _caps(caps)
+  {
+  }
+
+private:
+  // Heap capabilities
+  const uint32_t _caps;
+
+  void *do_allocate(size_t bytes, size_t alignment) override
+  {
+    void *ptr = heap_caps_aligned_alloc(alignment, bytes, _caps);
+    // Same as operator new without exceptions.
+    if (ptr == nullptr)
+      abort();
+    return ptr;
+  }
+
+  void do_deallocate(void *ptr, size_t, size_t) override
+  {
+    heap_caps_free(ptr);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+};
+
+#endif
+
+#ifdef __linux__
+
+/// @brief Memory resource that maps huge pages, so a large buffer does not miss the TLB.
+/// If no huge pages are reserved (vm.nr_hugepages), the memory is mapped with normal pages
+/// and transparent huge pages are requested for it.
+/// A mapping is a multiple of the huge page size, so the allocations are carved from the newest mapping while they fit:
+/// the data and the line markers of a buffer (and several small buffers) share one mapping instead of taking
+/// a huge page each. A mapping is unmapped when all its allocations are freed.
+class HugePageMemoryResource : public std::pmr::memory_resource
+{
+public:
+  /// @param hugePageSize size of the huge page, 2 MB on x86-64
+  explicit HugePageMemoryResource(size_t hugePageSize = 2 * 1024 * 1024)
+      : _hugePageSize(hugePageSize)
+  {
+  }
+
+  ~HugePageMemoryResource()
+  {
+    for (const Mapping &mapping : _mappings)
+      munmap(mapping.base, mapping.size);
+  }
+
+private:
+  /// Memory mapped by the resource.
+  struct Mapping
+  {
+    // Start of the mapping
+    uint8_t *base;
+    // Size of the mapping, a multiple of the huge page size
+    size_t size;
+    // Count of bytes carved from the start of the mapping
+    size_t used;
+    // Count of allocations not freed yet
+    size_t allocations;
+  };
+
+  // Size of the huge page
+  const size_t _hugePageSize;
+  // Mappings in order of creation, the allocations are carved from the last one
+  std::vector<Mapping> _mappings;
+  // Guards the mappings
+  std::mutex _mutex;
+
+  size_t roundUp(size_t bytes) const
+  {
+    return (bytes + _hugePageSize - 1) / _hugePageSize * _hugePageSize;
+  }
+
+  /// @brief Carve the allocation from the mapping.
+  /// @return nullptr if it does not fit
+  static void *carve(Mapping &mapping, size_t bytes, size_t alignment)
+  {
+    size_t offset = (reinterpret_cast<uintptr_t>(mapping.base) + mapping.used + alignment - 1) / alignment * alignment -
+                    reinterpret_cast<uintptr_t>(mapping.base);
+    if (offset >= mapping.size || bytes > mapping.size - offset)
+      return nullptr;
+    mapping.used = offset + bytes;
+    mapping.allocations++;
+    return mapping.base + offset;
+  }
+
+  /// @brief Map normal pages aligned to the huge page size and request transparent huge pages for them:
+  /// the kernel backs only the aligned huge page ranges of a mapping with huge pages.
+  void *mapAligned(size_t size)
+  {
+    void *mapped = mmap(nullptr, size + _hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED)
+      throw std::bad_alloc();
+
+    // The pages before and after the aligned range are unmapped.
+    uintptr_t start = reinterpret_cast<uintptr_t>(mapped);
+    uintptr_t aligned = (start + _hugePageSize - 1) / _hugePageSize * _hugePageSize;
+    if (aligned > start)
+      munmap(mapped, aligned - start);
+    if (start + _hugePageSize > aligned)
+      munmap(reinterpret_cast<void *>(aligned + size), start + _hugePageSize - aligned);
+
+    void *base = reinterpret_cast<void *>(aligned);
+    madvise(base, size, MADV_HUGEPAGE);
+    return base;
+  }
+
+  void *do_allocate(size_t bytes, size_t alignment) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    void *ptr = _mappings.empty() ? nullptr : carve(_mappings.back(), bytes, alignment);
+    if (ptr != nullptr)
+      return ptr;
+
+    // The mapping is aligned to the page at least, a larger alignment is found inside it.
+    size_t size = roundUp(bytes + alignment - 1);
+    void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base == MAP_FAILED)
+      base = mapAligned(size);
+    _mappings.push_back({static_cast<uint8_t *>(base), size, 0, 0});
+    return carve(_mappings.back(), bytes, alignment);
+  }
+
+  void do_deallocate(void *ptr, size_t, size_t) override
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto mapping = _mappings.begin(); mapping != _mappings.end(); ++mapping)
+    {
+      if (static_cast<uint8_t *>(ptr) < mapping->base || static_cast<uint8_t *>(ptr) >= mapping->base + mapping->size)
+        continue;
+      if (--mapping->allocations == 0)
+      {
+        munmap(mapping->base, mapping->size);
+        _mappings.erase(mapping);
+      }
+      return;
+    }
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+};
+
+#endif
+
+#endif
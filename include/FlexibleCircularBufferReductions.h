@@ -0,0 +1,297 @@
+#pragma once
+
+#ifndef FlexibleCircularBufferReductions_h
+#define FlexibleCircularBufferReductions_h
+
+#include "FlexibleCircularBuffer.h"
+
+#include <limits>
+
+// Vector kernels are selected by the target of the compiler (-mavx2, -msse4.1, NEON).
+// Define FlexibleCircularBuffer_NoSimd to use only the scalar code.
+#ifndef FlexibleCircularBuffer_NoSimd
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define FlexibleCircularBuffer_Avx2
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define FlexibleCircularBuffer_Sse
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define FlexibleCircularBuffer_Neon
+#endif
+#endif
+
+/// @brief Minimum, maximum and sum of numbers.
+/// @tparam T Type of the numbers.
+template <typename T>
+struct LineStatistics
+{
+public:
+  /// Type of the sum: double for floating point numbers, 64-bit integer for integers.
+  typedef typename std::conditional<std::is_floating_point<T>::value, double,
+                                    typename std::conditional<std::is_signed<T>::value, int64_t, uint64_t>::type>::type SumT;
+
+  /// Minimum, std::numeric_limits<T>::max() if there are no numbers
+  T min = std::numeric_limits<T>::max();
+  /// Maximum, std::numeric_limits<T>::lowest() if there are no numbers
+  T max = std::numeric_limits<T>::lowest();
+  /// Sum
+  SumT sum = 0;
+  /// Count of numbers
+  uint32_t count = 0;
+
+  /// Get the mean, 0 if there are no numbers
+  double GetMean() const
+  {
+    return count > 0 ? (double)sum / count : 0;
+  }
+
+  /// Add the statistics of other numbers.
+  void Merge(const LineStatistics &other)
+  {
+    min = other.min < min ? other.min : min;
+    max = other.max > max ? other.max : max;
+    sum += other.sum;
+    count += other.count;
+  }
+};
+
+/// @brief Reductions over the lines of a buffer of numbers, computed in place on the one or two parts of each line.
+/// float and int32_t use AVX2, SSE4.1 or NEON (AArch64) kernels when the compiler targets them,
+/// the other arithmetic types and the remainders use scalar code.
+/// A NaN is skipped by the minimum and the maximum in both (the sum and the mean are NaN).
+/// @tparam T Type of the buffer, an arithmetic type.
+template <typename T>
+class LineReducer
+{
+  static_assert(std::is_arithmetic<T>::value, "Only numbers can be reduced");
+
+public:
+  /// @brief Get the statistics of a line.
+  static LineStatistics<T> Reduce(const BufferLineView<T> &line)
+  {
+    LineStatistics<T> stats;
+    reduceSpan(line.first, line.firstLength, stats);
+    if (line.second != nullptr)
+      reduceSpan(line.second, line.secondLength, stats);
+    return stats;
+  }
+
+  /// @brief Get the statistics of a line by its id.
+  /// @return false if the line was not found
+  static bool Reduce(FlexibleCircularBuffer<T> &buffer, uint32_t id, LineStatistics<T> &stats)
+  {
+    return buffer.VisitLine(id, [&](const BufferLineView<T> &line)
+                            { stats = Reduce(line); });
+  }
+
+  /// @brief Get the statistics of all the numbers of a range of lines, and of each line.
+  /// @param buffer the buffer
+  /// @param fromId id of the first line (or the first line of the buffer, if it was overwritten)
+  /// @param toId id of the last line
+  /// @param perLine callable with (const BufferLineView<T> &, const LineStatistics<T> &)
+  /// @return statistics of all the numbers
+  template <typename PerLine>
+  static LineStatistics<T> ReduceLines(FlexibleCircularBuffer<T> &buffer, uint32_t fromId, uint32_t toId, PerLine &&perLine)
+  {
+    LineStatistics<T> total;
+    buffer.VisitLines(fromId, [&](const BufferLineView<T> &line)
+                      {
+                        if ((int32_t)(line.id - toId) > 0)
+                          return false;
+                        LineStatistics<T> stats = Reduce(line);
+                        perLine(line, static_cast<const LineStatistics<T> &>(stats));
+                        total.Merge(stats);
+                        return true; });
+    return total;
+  }
+
+  /// @brief Get the statistics of all the numbers of a range of lines.
+  static LineStatistics<T> ReduceLines(FlexibleCircularBuffer<T> &buffer, uint32_t fromId, uint32_t toId)
+  {
+    return ReduceLines(buffer, fromId, toId, [](const BufferLineView<T> &, const LineStatistics<T> &) {});
+  }
+
+private:
+  static void reduceSpan(const T *data, uint16_t count, LineStatistics<T> &stats)
+  {
+    uint16_t i = reduceVector(data, count, stats);
+    for (; i < count; i++)
+    {
+      stats.min = data[i] < stats.min ? data[i] : stats.min;
+      stats.max = data[i] > stats.max ? data[i] : stats.max;
+      stats.sum += data[i];
+    }
+    stats.count += count;
+  }
+
+  /// @brief Fold the lanes of a vector kernel into the statistics.
+  template <typename LaneSumT, size_t Lanes, size_t SumLanes>
+  static void foldLanes(const T (&mins)[Lanes], const T (&maxs)[Lanes], const LaneSumT (&sums)[SumLanes], LineStatistics<T> &stats)
+  {
+    for (size_t lane = 0; lane < Lanes; lane++)
+    {
+      stats.min = mins[lane] < stats.min ? mins[lane] : stats.min;
+      stats.max = maxs[lane] > stats.max ? maxs[lane] : stats.max;
+    }
+    for (size_t lane = 0; lane < SumLanes; lane++)
+      stats.sum += sums[lane];
+  }
+
+  /// @brief Reduce the beginning of the data with the vector kernel of the target.
+  /// @return count of reduced numbers, the rest is reduced by the scalar code
+  static uint16_t reduceVector([[maybe_unused]] const T *data, [[maybe_unused]] uint16_t count, [[maybe_unused]] LineStatistics<T> &stats)
+  {
+#if defined(FlexibleCircularBuffer_Avx2)
+    if constexpr (std::is_same<T, float>::value)
+    {
+      if (count < 8)
+        return 0;
+      // The lanes start like the scalar code, and min_ps/max_ps return the second operand if one is NaN,
+      // so a NaN is skipped as it is by the scalar comparisons.
+      __m256 vmin = _mm256_set1_ps(std::numeric_limits<float>::max()), vmax = _mm256_set1_ps(std::numeric_limits<float>::lowest());
+      __m256d sumLow = _mm256_setzero_pd(), sumHigh = _mm256_setzero_pd();
+      uint16_t i = 0;
+      for (; i + 8 <= count; i += 8)
+      {
+        __m256 v = _mm256_loadu_ps(data + i);
+        vmin = _mm256_min_ps(v, vmin);
+        vmax = _mm256_max_ps(v, vmax);
+        sumLow = _mm256_add_pd(sumLow, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+        sumHigh = _mm256_add_pd(sumHigh, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+      }
+      float mins[8], maxs[8];
+      double sums[4];
+      _mm256_storeu_ps(mins, vmin);
+      _mm256_storeu_ps(maxs, vmax);
+      _mm256_storeu_pd(sums, _mm256_add_pd(sumLow, sumHigh));
+      foldLanes(mins, maxs, sums, stats);
+      return i;
+    }
+    else if constexpr (std::is_same<T, int32_t>::value)
+    {
+      if (count < 8)
+        return 0;
+      __m256i vmin = _mm256_loadu_si256((const __m256i *)data), vmax = vmin;
+      __m256i sumLow = _mm256_setzero_si256(), sumHigh = _mm256_setzero_si256();
+      uint16_t i = 0;
+      for (; i + 8 <= count; i += 8)
+      {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        vmin = _mm256_min_epi32(vmin, v);
+        vmax = _mm256_max_epi32(vmax, v);
+        sumLow = _mm256_add_epi64(sumLow, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+        sumHigh = _mm256_add_epi64(sumHigh, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+      }
+      int32_t mins[8], maxs[8];
+      int64_t sums[4];
+      _mm256_storeu_si256((__m256i *)mins, vmin);
+      _mm256_storeu_si256((__m256i *)maxs, vmax);
+      _mm256_storeu_si256((__m256i *)sums, _mm256_add_epi64(sumLow, sumHigh));
+      foldLanes(mins, maxs, sums, stats);
+      return i;
+    }
+#elif defined(FlexibleCircularBuffer_Sse)
+    if constexpr (std::is_same<T, float>::value)
+    {
+      if (count < 4)
+        return 0;
+      // The lanes start like the scalar code, and min_ps/max_ps return the second operand if one is NaN,
+      // so a NaN is skipped as it is by the scalar comparisons.
+      __m128 vmin = _mm_set1_ps(std::numeric_limits<float>::max()), vmax = _mm_set1_ps(std::numeric_limits<float>::lowest());
+      __m128d sumLow = _mm_setzero_pd(), sumHigh = _mm_setzero_pd();
+      uint16_t i = 0;
+      for (; i + 4 <= count; i += 4)
+      {
+        __m128 v = _mm_loadu_ps(data + i);
+        vmin = _mm_min_ps(v, vmin);
+        vmax = _mm_max_ps(v, vmax);
+        sumLow = _mm_add_pd(sumLow, _mm_cvtps_pd(v));
+        sumHigh = _mm_add_pd(sumHigh, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+      }
+      float mins[4], maxs[4];
+      double sums[2];
+      _mm_storeu_ps(mins, vmin);
+      _mm_storeu_ps(maxs, vmax);
+      _mm_storeu_pd(sums, _mm_add_pd(sumLow, sumHigh));
+      foldLanes(mins, maxs, sums, stats);
+      return i;
+    }
+    else if constexpr (std::is_same<T, int32_t>::value)
+    {
+      if (count < 4)
+        return 0;
+      __m128i vmin = _mm_loadu_si128((const __m128i *)data), vmax = vmin;
+      __m128i sumLow = _mm_setzero_si128(), sumHigh = _mm_setzero_si128();
+      uint16_t i = 0;
+      for (; i + 4 <= count; i += 4)
+      {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        vmin = _mm_min_epi32(vmin, v);
+        vmax = _mm_max_epi32(vmax, v);
+        sumLow = _mm_add_epi64(sumLow, _mm_cvtepi32_epi64(v));
+        sumHigh = _mm_add_epi64(sumHigh, _mm_cvtepi32_epi64(_mm_unpackhi_epi64(v, v)));
+      }
+      int32_t mins[4], maxs[4];
+      int64_t sums[2];
+      _mm_storeu_si128((__m128i *)mins, vmin);
+      _mm_storeu_si128((__m128i *)maxs, vmax);
+      _mm_storeu_si128((__m128i *)sums, _mm_add_epi64(sumLow, sumHigh));
+      foldLanes(mins, maxs, sums, stats);
+      return i;
+    }
+#elif defined(FlexibleCircularBuffer_Neon)
+    if constexpr (std::is_same<T, float>::value)
+    {
+      if (count < 4)
+        return 0;
+      // The lanes start like the scalar code, and minnm/maxnm return the number if one operand is NaN,
+      // so a NaN is skipped as it is by the scalar comparisons.
+      float32x4_t vmin = vdupq_n_f32(std::numeric_limits<float>::max()), vmax = vdupq_n_f32(std::numeric_limits<float>::lowest());
+      float64x2_t sumLow = vdupq_n_f64(0), sumHigh = vdupq_n_f64(0);
+      uint16_t i = 0;
+      for (; i + 4 <= count; i += 4)
+      {
+        float32x4_t v = vld1q_f32(data + i);
+        vmin = vminnmq_f32(vmin, v);
+        vmax = vmaxnmq_f32(vmax, v);
+        sumLow = vaddq_f64(sumLow, vcvt_f64_f32(vget_low_f32(v)));
+        sumHigh = vaddq_f64(sumHigh, vcvt_high_f64_f32(v));
+      }
+      float mins[4], maxs[4];
+      double sums[2];
+      vst1q_f32(mins, vmin);
+      vst1q_f32(maxs, vmax);
+      vst1q_f64(sums, vaddq_f64(sumLow, sumHigh));
+      foldLanes(mins, maxs, sums, stats);
+      return i;
+    }
+    else if constexpr (std::is_same<T, int32_t>::value)
+    {
+      if (count < 4)
+        return 0;
+      int32x4_t vmin = vld1q_s32(data), vmax = vmin;
+      int64x2_t sum = vdupq_n_s64(0);
+      uint16_t i = 0;
+      for (; i + 4 <= count; i += 4)
+      {
+        int32x4_t v = vld1q_s32(data + i);
+        vmin = vminq_s32(vmin, v);
+        vmax = vmaxq_s32(vmax, v);
+        sum = vpadalq_s32(sum, v);
+      }
+      int32_t mins[4], maxs[4];
+      int64_t sums[2];
+      vst1q_s32(mins, vmin);
+      vst1q_s32(maxs, vmax);
+      vst1q_s64(sums, sum);
+      foldLanes(mins, maxs, sums, stats);
+      return i;
+    }
+#endif
+    return 0;
+  }
+};
+
+#endif
@@ -0,0 +1,209 @@
+#pragma once
+
+#ifndef FlexibleCircularBufferSearch_h
+#define FlexibleCircularBufferSearch_h
+
+#include "FlexibleCircularBuffer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// @brief Searches the lines of a buffer on a pool of threads, for host builds with large buffers.
+/// The markers are copied under the lock, then the data is scanned without it, so the writers are not blocked
+/// during the scan. The lines overwritten during the scan are dropped from the results, and a chunk whose lines
+/// were changed during the scan (see FlexibleCircularBuffer::GetGeneration) is checked again under the lock.
+/// @tparam BuffT Type of the buffer, must be trivially copyable.
+template <typename BuffT>
+class ParallelLineSearch
+{
+  static_assert(std::is_trivially_copyable<BuffT>::value, "The data is read without the lock, only trivially copyable types can be read so");
+
+public:
+  /// @brief Constructor, starts the threads.
+  /// @param buffer the buffer
+  /// @param threadCount count of threads, the calling thread works too. 0 for the count of cores - 1
+  ParallelLineSearch(FlexibleCircularBuffer<BuffT> &buffer, unsigned threadCount = 0)
+      : _buffer(buffer),
+        _markers(buffer.GetMaxLines())
+  {
+    if (threadCount == 0)
+      threadCount = std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 1;
+    for (unsigned i = 0; i < threadCount; i++)
+      _threads.emplace_back(&ParallelLineSearch::run, this);
+  }
+
+  ~ParallelLineSearch()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+    }
+    _wakeUp.notify_all();
+    for (std::thread &thread : _threads)
+      thread.join();
+  }
+
+  ParallelLineSearch(const ParallelLineSearch &) = delete;
+  ParallelLineSearch &operator=(const ParallelLineSearch &) = delete;
+
+  /// @brief Count the lines that match the predicate.
+  /// @param predicate callable with (const BufferLineView<BuffT> &), called from several threads at once
+  /// @return count of matching lines
+  template <typename Predicate>
+  uint32_t CountIf(Predicate &&predicate)
+  {
+    uint32_t count = 0;
+    scan(predicate, [&](uint32_t)
+         { count++;
+           return true; });
+    return count;
+  }
+
+  /// @brief Pass the lines that match the predicate to the visitor, in order of ids.
+  /// The visitor gets the line under the lock of the buffer, so it sees consistent data.
+  /// @param predicate callable with (const BufferLineView<BuffT> &), called from several threads at once
+  /// @param visitor callable with (const BufferLineView<BuffT> &), returns false to stop
+  /// @return count of visited lines
+  template <typename Predicate, typename Visitor>
+  uint32_t Search(Predicate &&predicate, Visitor &&visitor)
+  {
+    uint32_t count = 0;
+    scan(predicate, [&](uint32_t id)
+         {
+           bool next = true;
+           // A line that still matches is visited, the writer may have changed the last line since the scan.
+           _buffer.VisitLine(id, [&](const BufferLineView<BuffT> &line)
+                             {
+                               if (!predicate(line))
+                                 return;
+                               count++;
+                               next = visitor(line); });
+           return next; });
+    return count;
+  }
+
+private:
+  // The searched buffer
+  FlexibleCircularBuffer<BuffT> &_buffer;
+  // Markers copied at the start of a scan
+  std::vector<BufferLineMarker> _markers;
+  // Ids of the matching lines of each chunk
+  std::vector<std::vector<uint32_t>> _matches;
+  // Worker threads
+  std::vector<std::thread> _threads;
+
+  // Serializes the scans
+  std::mutex _scanMutex;
+  // Guards the fields of the current job
+  std::mutex _mutex;
+  std::condition_variable _wakeUp;
+  std::condition_variable _finished;
+  // Job of the current scan, nullptr if none
+  const std::function<void(size_t)> *_job = nullptr;
+  size_t _chunkCount = 0;
+  size_t _nextChunk = 0;
+  size_t _doneChunks = 0;
+  bool _stopping = false;
+
+  /// @brief Find the matching lines in chunks aligned to the lines, then pass their ids to the function in order.
+  template <typename Predicate, typename Function>
+  void scan(Predicate &predicate, Function &&function)
+  {
+    std::lock_guard<std::mutex> scanLock(_scanMutex);
+
+    // Every chunk is compared with the generation of the markers, not with the generation when the chunk starts:
+    // a line changed between the copy and the start of a chunk would not be noticed otherwise.
+    uint32_t generation;
+    uint16_t lineCount = _buffer.CopyLineMarkers(_markers.data(), &generation);
+    if (lineCount == 0)
+      return;
+
+    size_t chunkCount = std::min<size_t>(lineCount, (_threads.size() + 1) * 4);
+    _matches.resize(chunkCount);
+    std::function<void(size_t)> job = [&](size_t chunk)
+    {
+      std::vector<uint32_t> &matches = _matches[chunk];
+      matches.clear();
+      size_t begin = lineCount * chunk / chunkCount;
+      size_t end = lineCount * (chunk + 1) / chunkCount;
+      for (size_t i = begin; i < end; i++)
+        if (predicate(_buffer.ViewOfMarker(_markers[i])))
+          matches.push_back(_markers[i].id);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (_buffer.GetGeneration() == generation)
+        return;
+
+      // A writer changed the lines meanwhile, the data may have been torn: the lines are read again under the lock.
+      matches.clear();
+      uint32_t lastId = _markers[end - 1].id;
+      _buffer.VisitLines(_markers[begin].id, [&](const BufferLineView<BuffT> &line)
+                         {
+                           if ((int32_t)(line.id - lastId) > 0)
+                             return false;
+                           if (predicate(line))
+                             matches.push_back(line.id);
+                           return true; });
+    };
+    runChunks(job, chunkCount);
+
+    // The lines that are still in the buffer were not overwritten while they were read.
+    uint32_t firstId, lastId;
+    if (!_buffer.GetIdRange(firstId, lastId))
+      return;
+    for (size_t chunk = 0; chunk < chunkCount; chunk++)
+      for (uint32_t id : _matches[chunk])
+        if ((int32_t)(id - firstId) >= 0 && !function(id))
+          return;
+  }
+
+  /// @brief Run the job for each chunk on the threads and on the calling thread, return when all chunks are done.
+  void runChunks(const std::function<void(size_t)> &job, size_t chunkCount)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _job = &job;
+    _chunkCount = chunkCount;
+    _nextChunk = 0;
+    _doneChunks = 0;
+    _wakeUp.notify_all();
+
+    while (_nextChunk < _chunkCount)
+    {
+      size_t chunk = _nextChunk++;
+      lock.unlock();
+      job(chunk);
+      lock.lock();
+      _doneChunks++;
+    }
+    _finished.wait(lock, [&]
+                   { return _doneChunks == _chunkCount; });
+    _job = nullptr;
+  }
+
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;)
+    {
+      _wakeUp.wait(lock, [&]
+                   { return _stopping || (_job != nullptr && _nextChunk < _chunkCount); });
+      if (_stopping)
+        return;
+
+      // The job stays valid until all its chunks are done.
+      const std::function<void(size_t)> *job = _job;
+      size_t chunk = _nextChunk++;
+      lock.unlock();
+      (*job)(chunk);
+      lock.lock();
+      if (++_doneChunks == _chunkCount)
+        _finished.notify_all();
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,333 @@
+#pragma once
+
+#ifndef FlexibleCircularBufferSegments_h
+#define FlexibleCircularBufferSegments_h
+
+#include "FlexibleCircularBuffer.h"
+#include "FlexibleCircularBufferTokens.h"
+
+#include <algorithm>
+#include <vector>
+
+#if ThreadSafe == FreeRTOS
+#include <freertos/semphr.h>
+#else
+#include <mutex>
+#endif
+
+/// @brief Summary of the lines that start in a segment of the buffer.
+/// It may describe lines that were already overwritten, but never misses a line of the segment.
+struct SegmentSummary
+{
+public:
+  /// Id of the first line
+  uint32_t firstId = 0;
+  /// Id of the last line
+  uint32_t lastId = 0;
+  /// Time of the oldest line
+  uint64_t minTimestamp = UINT64_MAX;
+  /// Time of the newest line
+  uint64_t maxTimestamp = 0;
+  /// Bit n is set if there is a line of level n.
+  uint32_t levelMask = 0;
+
+  /// Check if the segment has no lines.
+  bool IsEmpty() const
+  {
+    return levelMask == 0;
+  }
+};
+
+/// @brief Conditions of SegmentSummaryIndex::VisitMatching, the default values match all lines.
+struct SegmentQuery
+{
+public:
+  /// Time of the oldest line
+  uint64_t fromTimestamp = 0;
+  /// Time of the newest line
+  uint64_t toTimestamp = UINT64_MAX;
+  /// Bit n is set if lines of level n match.
+  uint32_t levelMask = UINT32_MAX;
+  /// Token the line has to contain (text only), nullptr for any line. The segments without the token are skipped,
+  /// the visitor still gets the lines of the other segments that do not contain it.
+  const char *token = nullptr;
+  /// Length of the token
+  uint16_t tokenLength = 0;
+};
+
+/// @brief Splits the data of the buffer into segments of a fixed count of cells and keeps a summary of each one,
+/// updated when a line is written: id range, time range, level mask and a Bloom filter of the tokens.
+/// A query reads only the lines of the segments whose summary matches, the other segments are skipped.
+/// The Bloom filter has one bit per cell of the segment (64 to MaxBloomBits bits) and sets 2 bits per token:
+/// with tokens of about 8 characters, a segment without the token matches it in about 5% of the queries,
+/// more for segments larger than MaxBloomBits cells.
+/// @tparam BuffT Type of the buffer.
+template <typename BuffT>
+class SegmentSummaryIndex : private FlexibleCircularBufferObserver<BuffT>
+{
+public:
+  /// Maximum size of the Bloom filter of a segment in bits.
+  static const uint16_t MaxBloomBits = 1024;
+
+  /// @brief Get the level of a line, from 0 to 31.
+  typedef uint8_t (*LevelClassifier)(const BufferLineView<BuffT> &line);
+
+  /// @brief Constructor, the index is attached to the buffer until it is destroyed.
+  /// Only the lines written after the constructor are indexed.
+  /// @param buffer the buffer
+  /// @param segmentSize count of cells in a segment
+  /// @param levelOf level of a line, nullptr if all the lines have level 0
+  SegmentSummaryIndex(FlexibleCircularBuffer<BuffT> &buffer, uint16_t segmentSize = 1024, LevelClassifier levelOf = nullptr)
+      : _buffer(buffer),
+        _segmentSize(segmentSize),
+        _levelOf(levelOf),
+        _summaries((buffer.GetBufferSize() + segmentSize - 1) / segmentSize),
+        _bloomWords((segmentSize < 64 ? 64 : segmentSize > MaxBloomBits ? MaxBloomBits : segmentSize) / 64),
+        _blooms((_summaries.size() + 1) * _bloomWords)
+  {
+#if ThreadSafe == FreeRTOS
+    _mutex = xSemaphoreCreateMutex();
+#endif
+    _attached = _buffer.AddObserver(this);
+  }
+
+  ~SegmentSummaryIndex()
+  {
+    _buffer.RemoveObserver(this);
+#if ThreadSafe == FreeRTOS
+    vSemaphoreDelete(_mutex);
+#endif
+  }
+
+  SegmentSummaryIndex(const SegmentSummaryIndex &) = delete;
+  SegmentSummaryIndex &operator=(const SegmentSummaryIndex &) = delete;
+
+  /// @brief Check if the index observes the buffer. It does not if the buffer had FlexibleCircularBuffer::MaxObservers
+  /// observers already, then no line is indexed.
+  bool IsAttached() const
+  {
+    return _attached;
+  }
+
+  /// @brief Pass the lines of the segments that may match the query to the visitor, in order of ids.
+  /// The time and the level are checked for each line, the token only for the segments (text only).
+  /// @param query conditions
+  /// @param visitor callable with (const BufferLineView<BuffT> &), returns false to stop
+  /// @return count of visited lines
+  template <typename Visitor>
+  uint32_t VisitMatching(const SegmentQuery &query, Visitor &&visitor)
+  {
+    // Without tokens the segments are never skipped by a token.
+    bool hasToken = std::is_same<BuffT, char>::value && query.token != nullptr;
+    uint32_t tokenHash = hasToken ? FlexibleCircularBufferTokenHash(query.token, query.tokenLength) : 0;
+
+    // The id ranges are collected first, so the buffer is not locked while the index is.
+    std::vector<SegmentSummary> candidates;
+    lock();
+    for (size_t segment = 0; segment < _summaries.size(); segment++)
+      if (mayMatch(_summaries[segment], query) && (!hasToken || bloomContains(bloomOf(segment), tokenHash)))
+        candidates.push_back(_summaries[segment]);
+    if (_pendingSegment >= 0 && mayMatch(_pending, query) && (!hasToken || bloomContains(bloomOf(PendingBloom), tokenHash)))
+      candidates.push_back(_pending);
+    _skippedSegments += _summaries.size() + (_pendingSegment >= 0 ? 1 : 0) - candidates.size();
+    unlock();
+
+    std::sort(candidates.begin(), candidates.end(), [](const SegmentSummary &a, const SegmentSummary &b)
+              { return (int32_t)(a.firstId - b.firstId) < 0; });
+
+    uint32_t count = 0;
+    bool stopped = false;
+    uint32_t nextId = 0;
+    for (size_t i = 0; i < candidates.size() && !stopped; i++)
+    {
+      const SegmentSummary &segment = candidates[i];
+      // The ranges of a segment and of its pending summary never overlap, but the lines already visited are skipped anyway.
+      uint32_t fromId = i > 0 && (int32_t)(nextId - segment.firstId) > 0 ? nextId : segment.firstId;
+      if ((int32_t)(fromId - segment.lastId) > 0)
+        continue;
+
+      _buffer.VisitLines(fromId, [&](const BufferLineView<BuffT> &line)
+                         {
+                           if ((int32_t)(line.id - fromId) < 0)
+                             return true;
+                           if ((int32_t)(line.id - segment.lastId) > 0)
+                             return false;
+                           nextId = line.id + 1;
+                           if (line.timestamp < query.fromTimestamp || line.timestamp > query.toTimestamp ||
+                               (query.levelMask & (1u << levelOf(line))) == 0)
+                             return true;
+                           count++;
+                           stopped = !visitor(line);
+                           return !stopped; });
+    }
+    return count;
+  }
+
+  /// @brief Get the count of segments skipped by the queries.
+  uint32_t GetSkippedSegments()
+  {
+    lock();
+    uint32_t ret = _skippedSegments;
+    unlock();
+    return ret;
+  }
+
+private:
+  // The indexed buffer
+  FlexibleCircularBuffer<BuffT> &_buffer;
+  // Set if the index got an observer slot of the buffer
+  bool _attached = false;
+  // Count of cells in a segment
+  const uint16_t _segmentSize;
+  // Level of a line
+  const LevelClassifier _levelOf;
+  // Summaries of the segments
+  std::vector<SegmentSummary> _summaries;
+  // Count of 64-bit words of the Bloom filter of a segment
+  const uint16_t _bloomWords;
+  // Bloom filters of the tokens of the segments, _bloomWords each, then the filter of _pending
+  std::vector<uint64_t> _blooms;
+  // Segment of the Bloom filter of _pending
+  static const int32_t PendingBloom = -1;
+  // Summary of the older lines of the segment being overwritten, they are evicted when the writer leaves the segment.
+  SegmentSummary _pending;
+  // Segment of _pending, -1 if none
+  int32_t _pendingSegment = -1;
+  // Segment of the last written line
+  int32_t _currentSegment = -1;
+  // Count of segments skipped by the queries
+  uint32_t _skippedSegments = 0;
+
+#if ThreadSafe == FreeRTOS
+  SemaphoreHandle_t _mutex = nullptr;
+#else
+  std::mutex _mutex;
+#endif
+
+  void lock()
+  {
+#if ThreadSafe == FreeRTOS
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+#else
+    _mutex.lock();
+#endif
+  }
+
+  void unlock()
+  {
+#if ThreadSafe == FreeRTOS
+    xSemaphoreGive(_mutex);
+#else
+    _mutex.unlock();
+#endif
+  }
+
+  uint8_t levelOf(const BufferLineView<BuffT> &line) const
+  {
+    return _levelOf != nullptr ? _levelOf(line) & 31 : 0;
+  }
+
+  /// @brief Get the Bloom filter of the segment, or of _pending for PendingBloom.
+  uint64_t *bloomOf(int32_t segment)
+  {
+    return &_blooms[(segment == PendingBloom ? _summaries.size() : segment) * _bloomWords];
+  }
+
+  /// @brief Two bits of the Bloom filter from the hash, from its low and high halves.
+  void bloomBits(uint32_t hash, uint32_t &first, uint32_t &second) const
+  {
+    uint32_t bits = _bloomWords * 64;
+    first = (hash & 0xFFFF) % bits;
+    second = (hash >> 16) % bits;
+  }
+
+  void addToBloom(uint64_t *bloom, uint32_t hash) const
+  {
+    uint32_t first, second;
+    bloomBits(hash, first, second);
+    bloom[first / 64] |= 1ull << (first % 64);
+    bloom[second / 64] |= 1ull << (second % 64);
+  }
+
+  bool bloomContains(const uint64_t *bloom, uint32_t hash) const
+  {
+    uint32_t first, second;
+    bloomBits(hash, first, second);
+    return (bloom[first / 64] & (1ull << (first % 64))) != 0 && (bloom[second / 64] & (1ull << (second % 64))) != 0;
+  }
+
+  /// @brief Add the tokens of the line to the Bloom filter.
+  void addTokens(uint64_t *bloom, const BufferLineView<BuffT> &line) const
+  {
+    if constexpr (std::is_same<BuffT, char>::value)
+      FlexibleCircularBufferForEachToken(line, [&](uint32_t hash, uint16_t, uint16_t)
+                                         { addToBloom(bloom, hash); });
+  }
+
+  static bool mayMatch(const SegmentSummary &summary, const SegmentQuery &query)
+  {
+    return !summary.IsEmpty() &&
+           summary.maxTimestamp >= query.fromTimestamp && summary.minTimestamp <= query.toTimestamp &&
+           (summary.levelMask & query.levelMask) != 0;
+  }
+
+  /// Called by the buffer with its lock taken, after a line was written or data was added to the last line.
+  void OnLineWritten(const BufferLineView<BuffT> &line) override
+  {
+    // The pinned lines are not in the segments of the buffer.
+    if (line.pinned)
+      return;
+    int32_t segment = (line.first - _buffer.GetStorage()) / _segmentSize;
+
+    lock();
+    if (segment != _currentSegment)
+    {
+      // The writer entered the segment, the older lines that start in it are overwritten until it leaves.
+      _pending = _summaries[segment];
+      _pendingSegment = segment;
+      _summaries[segment] = SegmentSummary();
+      std::copy_n(bloomOf(segment), _bloomWords, bloomOf(PendingBloom));
+      std::fill_n(bloomOf(segment), _bloomWords, 0);
+      _currentSegment = segment;
+    }
+
+    SegmentSummary &summary = _summaries[segment];
+    if (summary.IsEmpty())
+      summary.firstId = line.id;
+    summary.lastId = line.id;
+    summary.minTimestamp = std::min(summary.minTimestamp, line.timestamp);
+    summary.maxTimestamp = std::max(summary.maxTimestamp, line.timestamp);
+    summary.levelMask |= 1u << levelOf(line);
+    addTokens(bloomOf(segment), line);
+    unlock();
+  }
+
+  /// Called by the buffer with its lock taken, after the data of a line was replaced.
+  void OnLineUpdated(const BufferLineView<BuffT> &line) override
+  {
+    int32_t segment = (line.first - _buffer.GetStorage()) / _segmentSize;
+
+    // The summary keeps the levels and the tokens of the old data too, it only has to cover the new ones.
+    lock();
+    SegmentSummary *summary = &_summaries[segment];
+    if (segment == _pendingSegment && !covers(*summary, line.id))
+    {
+      summary = &_pending;
+      segment = PendingBloom;
+    }
+    // The lines written before the index was attached are not in any summary.
+    if (covers(*summary, line.id))
+    {
+      summary->levelMask |= 1u << levelOf(line);
+      addTokens(bloomOf(segment), line);
+    }
+    unlock();
+  }
+
+  static bool covers(const SegmentSummary &summary, uint32_t id)
+  {
+    return !summary.IsEmpty() && (int32_t)(id - summary.firstId) >= 0 && (int32_t)(summary.lastId - id) >= 0;
+  }
+};
+
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#ifndef FlexibleCircularBufferTokens_h
+#define FlexibleCircularBufferTokens_h
+
+#include "FlexibleCircularBuffer.h"
+
+// Tokens of text lines, used by the indexes: runs of letters, digits and '_', hashed with FNV-1a.
+
+/// @brief Check if the character is a part of a token.
+inline bool FlexibleCircularBufferIsTokenChar(char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+/// @brief Get the hash of a token.
+inline uint32_t FlexibleCircularBufferTokenHash(const char *token, uint16_t length)
+{
+  uint32_t hash = 2166136261u;
+  for (uint16_t i = 0; i < length; i++)
+    hash = (hash ^ (uint8_t)token[i]) * 16777619u;
+  return hash;
+}
+
+/// @brief Pass each token of the line to the function, the line is not copied.
+/// @param line the line
+/// @param function callable with (uint32_t hash, uint16_t offset, uint16_t length)
+template <typename Function>
+void FlexibleCircularBufferForEachToken(const BufferLineView<char> &line, Function &&function)
+{
+  uint32_t hash = 2166136261u;
+  uint16_t start = 0;
+  for (uint16_t i = 0, length = line.GetLength(); i <= length; i++)
+  {
+    char c = i < length ? line[i] : '\0';
+    if (FlexibleCircularBufferIsTokenChar(c))
+      hash = (hash ^ (uint8_t)c) * 16777619u;
+    else
+    {
+      if (i > start)
+        function(hash, start, (uint16_t)(i - start));
+      hash = 2166136261u;
+      start = i + 1;
+    }
+  }
+}
+
+#endif
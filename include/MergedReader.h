@@ -0,0 +1,148 @@
+#pragma once
+
+#ifndef MergedReader_h
+#define MergedReader_h
+
+#include "FlexibleCircularBuffer.h"
+
+#include <algorithm>
+#include <vector>
+
+/// @brief Reads the lines of several buffers as one sequence in order of time, with a k-way merge on a heap.
+/// Each buffer keeps its own eviction, for example one buffer per subsystem, and the reader interleaves them.
+/// The lines are passed to the visitor straight from the buffers, nothing is copied or allocated per line.
+/// To merge by a global sequence instead of time, write the lines with LineWriteOptions::timestamp from a shared counter.
+/// @tparam BuffT Type of the buffers.
+template <typename BuffT>
+class MergedReader
+{
+public:
+  /// @brief Constructor, the reader starts from the first lines of the buffers.
+  /// @param buffers the buffers, the index of a buffer in this array is passed to the visitor
+  /// @param count count of buffers
+  MergedReader(FlexibleCircularBuffer<BuffT> *const *buffers, uint8_t count)
+  {
+    _cursors.resize(count);
+    for (uint8_t i = 0; i < count; i++)
+      _cursors[i].buffer = buffers[i];
+    _heap.reserve(count);
+  }
+
+  MergedReader(const MergedReader &) = delete;
+  MergedReader &operator=(const MergedReader &) = delete;
+
+  /// @brief Pass the lines written since the previous call (or all the lines, the first time) to the visitor,
+  /// in order of time. Lines with the same time are passed in order of the buffers.
+  /// @param visitor callable with (const BufferLineView<BuffT> &, uint8_t buffer), returns false to stop
+  /// @return count of visited lines
+  template <typename Visitor>
+  uint32_t VisitMerged(Visitor &&visitor)
+  {
+    _heap.clear();
+    for (uint8_t i = 0; i < _cursors.size(); i++)
+      if (peek(_cursors[i]))
+        pushHeap(i);
+
+    uint32_t count = 0;
+    bool stopped = false;
+    while (!_heap.empty() && !stopped)
+    {
+      std::pop_heap(_heap.begin(), _heap.end(), _later);
+      uint8_t source = _heap.back();
+      _heap.pop_back();
+
+      Cursor &cursor = _cursors[source];
+      // The lines older than the first line were overwritten before they were read. The other lines passed over
+      // by the visit have expired or were superseded, they are not counted.
+      uint32_t firstId, lastId;
+      if (cursor.started && cursor.buffer->GetIdRange(firstId, lastId) && (int32_t)(firstId - cursor.nextId) > 0)
+      {
+        _skippedLines += firstId - cursor.nextId;
+        cursor.nextId = firstId;
+      }
+      cursor.buffer->VisitLines(cursor.nextId, [&](const BufferLineView<BuffT> &line)
+                                {
+                                  cursor.started = true;
+                                  cursor.nextId = line.id + 1;
+                                  count++;
+                                  stopped = !visitor(line, source);
+                                  return false; });
+
+      if (!stopped && peek(cursor))
+        pushHeap(source);
+    }
+    return count;
+  }
+
+  /// @brief Start again from the first lines of the buffers.
+  void Rewind()
+  {
+    for (Cursor &cursor : _cursors)
+    {
+      cursor.nextId = 0;
+      cursor.started = false;
+    }
+  }
+
+  /// @brief Get the count of lines overwritten before the reader got to them.
+  uint32_t GetSkippedLines() const
+  {
+    return _skippedLines;
+  }
+
+private:
+  /// Position of the reader in a buffer.
+  struct Cursor
+  {
+    FlexibleCircularBuffer<BuffT> *buffer = nullptr;
+    // Id of the next line, ignored until the first line is read
+    uint32_t nextId = 0;
+    // Time of the next line
+    uint64_t nextTimestamp = 0;
+    // Set after the first line was read
+    bool started = false;
+  };
+
+  /// Orders the heap so the earliest line is on top.
+  struct Later
+  {
+    const std::vector<Cursor> &cursors;
+
+    bool operator()(uint8_t a, uint8_t b) const
+    {
+      if (cursors[a].nextTimestamp != cursors[b].nextTimestamp)
+        return cursors[a].nextTimestamp > cursors[b].nextTimestamp;
+      return a > b;
+    }
+  };
+
+  std::vector<Cursor> _cursors;
+  // Indexes of the cursors that have a next line
+  std::vector<uint8_t> _heap;
+  Later _later{_cursors};
+  uint32_t _skippedLines = 0;
+
+  /// @brief Read the time of the next line of the cursor.
+  /// @return false if there is no next line
+  bool peek(Cursor &cursor)
+  {
+    uint32_t scannedId = cursor.nextId - 1;
+    bool found = cursor.buffer->VisitLines(cursor.started ? cursor.nextId : 0, [&](const BufferLineView<BuffT> &line)
+                                           {
+                                             cursor.nextTimestamp = line.timestamp;
+                                             return false; },
+                                           scannedId) > 0;
+    // The rest of the lines have expired or were superseded, the cursor moves past them.
+    if (!found && cursor.started)
+      cursor.nextId = scannedId + 1;
+    return found;
+  }
+
+  void pushHeap(uint8_t source)
+  {
+    _heap.push_back(source);
+    std::push_heap(_heap.begin(), _heap.end(), _later);
+  }
+};
+
+#endif
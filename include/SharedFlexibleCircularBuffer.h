@@ -0,0 +1,313 @@
+#pragma once
+
+#ifndef SharedFlexibleCircularBuffer_h
+#define SharedFlexibleCircularBuffer_h
+
+#include "FlexibleCircularBuffer.h"
+
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// @brief Header at the beginning of the shared memory segment.
+/// It holds only offsets, so every process can map the segment at any address.
+struct SharedBufferHeader
+{
+public:
+  /// Set last by the creator, when the segment is initialized.
+  std::atomic<uint32_t> magic;
+  /// Size of the buffer element, to check that all processes use the same type.
+  uint32_t elementSize;
+  /// Count of elements in the buffer
+  uint16_t bufferSize;
+  /// Maximum count of lines
+  uint16_t maxLines;
+  /// Offset of the line markers from the beginning of the segment.
+  uint32_t linesOffset;
+  /// Offset of the data from the beginning of the segment.
+  uint32_t dataOffset;
+  /// Count of times the lock was taken over from a process that died holding it.
+  uint32_t recoveries;
+  /// Process-shared robust mutex, guards everything below the header.
+  pthread_mutex_t mutex;
+  /// Positions of the lines
+  BufferRingState state;
+};
+
+/// @brief Circular buffer in a POSIX shared memory segment, so several processes can write to it and read from it.
+/// Writing takes only a process-shared mutex, there are no syscalls unless the mutex is contended.
+/// Only the lines and the consumers are shared: the features that keep state in the buffer object (observers, settings)
+/// are per process. A consumer cannot use ConsumerPolicy::Block, the writer would wait with the shared lock held,
+/// and BeginGroup fails, the state of a group is not shared.
+/// @tparam BuffT Type of the buffer, must be trivially copyable.
+template <typename BuffT>
+class SharedFlexibleCircularBuffer
+{
+  static_assert(std::is_trivially_copyable<BuffT>::value, "Only trivially copyable types can be shared between processes");
+
+public:
+  /// Value of SharedBufferHeader::magic of an initialized segment.
+  static const uint32_t Magic = 0x46434231; // "FCB1"
+
+  /// @brief Open the shared buffer, or create it if it does not exist.
+  /// @param name name of the shared memory object, for example "/app-log"
+  /// @param bufferSize count of elements in the buffer, used when the buffer is created
+  /// @param maxLines maximum count of lines, used when the buffer is created
+  SharedFlexibleCircularBuffer(const char *name, uint16_t bufferSize = 4096, uint16_t maxLines = 128)
+  {
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+    bool created = fd >= 0;
+    if (!created && errno == EEXIST)
+      fd = shm_open(name, O_RDWR, 0660);
+    if (fd < 0)
+      return;
+
+    if (created)
+    {
+      _mappedSize = calculateSize(bufferSize, maxLines);
+      if (ftruncate(fd, _mappedSize) != 0)
+      {
+        close(fd);
+        shm_unlink(name);
+        return;
+      }
+    }
+    else
+    {
+      // Wait until the creator sets the size of the segment.
+      struct stat st;
+      int result;
+      for (int attempt = 0; (result = fstat(fd, &st)) == 0 && st.st_size == 0 && attempt < 100; attempt++)
+        usleep(1000);
+      _mappedSize = result == 0 ? st.st_size : 0;
+    }
+
+    void *mapped = _mappedSize > 0 ? mmap(nullptr, _mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapped == MAP_FAILED)
+      return;
+    _header = static_cast<SharedBufferHeader *>(mapped);
+
+    if (created)
+      initialize(bufferSize, maxLines);
+    else if (!waitInitialized())
+    {
+      munmap(_header, _mappedSize);
+      _header = nullptr;
+      return;
+    }
+
+    uint8_t *base = reinterpret_cast<uint8_t *>(_header);
+    _buffer = new FlexibleCircularBuffer<BuffT>(base + _header->dataOffset, _header->bufferSize,
+                                                reinterpret_cast<BufferLineMarker *>(base + _header->linesOffset),
+                                                _header->maxLines, &_header->state);
+  }
+
+  /// @brief Unmap the segment, the buffer stays in shared memory until Unlink is called.
+  ~SharedFlexibleCircularBuffer()
+  {
+    delete _buffer;
+    if (_header != nullptr)
+      munmap(_header, _mappedSize);
+  }
+
+  SharedFlexibleCircularBuffer(const SharedFlexibleCircularBuffer &) = delete;
+  SharedFlexibleCircularBuffer &operator=(const SharedFlexibleCircularBuffer &) = delete;
+
+  /// @brief Remove the shared memory object, the processes that have it mapped can still use it.
+  static void Unlink(const char *name)
+  {
+    shm_unlink(name);
+  }
+
+  /// @brief Check if the buffer was opened.
+  bool IsOpen() const
+  {
+    return _buffer != nullptr;
+  }
+
+  /// @brief Write new line to buffer
+  /// @param data data
+  /// @param length data length
+  /// @return id of the created line. 0 if error
+  uint32_t WriteLine(const BuffT *data, uint16_t length)
+  {
+    return Access([&](FlexibleCircularBuffer<BuffT> &buffer)
+                  { return buffer.WriteLine(data, length); });
+  }
+
+  /// @brief Pass the lines to the visitor in order, starting from the line with given id.
+  /// @param fromId id of the first line to visit
+  /// @param visitor callable with (const BufferLineView<BuffT> &), returns false to stop
+  /// @return count of visited lines
+  template <typename Visitor>
+  uint16_t VisitLines(uint32_t fromId, Visitor &&visitor)
+  {
+    return Access([&](FlexibleCircularBuffer<BuffT> &buffer)
+                  { return buffer.VisitLines(fromId, visitor); });
+  }
+
+  /// @brief Call the function with the buffer while holding the shared lock, for any other operation.
+  /// @param function callable with (FlexibleCircularBuffer<BuffT> &)
+  /// @return the result of the function
+  template <typename Function>
+  auto Access(Function &&function) -> decltype(function(std::declval<FlexibleCircularBuffer<BuffT> &>()))
+  {
+    using Result = decltype(function(std::declval<FlexibleCircularBuffer<BuffT> &>()));
+    if (_buffer == nullptr || !lock())
+      return Result();
+
+    if constexpr (std::is_void<Result>::value)
+    {
+      function(*_buffer);
+      unlock();
+    }
+    else
+    {
+      Result ret = function(*_buffer);
+      unlock();
+      return ret;
+    }
+  }
+
+  /// @brief Get the count of times the lock was taken over from a process that died holding it.
+  uint32_t GetRecoveries() const
+  {
+    return _header != nullptr ? _header->recoveries : 0;
+  }
+
+private:
+  // Mapped segment
+  SharedBufferHeader *_header = nullptr;
+  // Size of the mapped segment
+  size_t _mappedSize = 0;
+  // Buffer attached to the segment
+  FlexibleCircularBuffer<BuffT> *_buffer = nullptr;
+
+  static size_t alignUp(size_t offset, size_t alignment)
+  {
+    return (offset + alignment - 1) / alignment * alignment;
+  }
+
+  static size_t linesOffset()
+  {
+    return alignUp(sizeof(SharedBufferHeader), alignof(BufferLineMarker));
+  }
+
+  static size_t dataOffset(uint16_t maxLines)
+  {
+    return alignUp(linesOffset() + sizeof(BufferLineMarker) * maxLines, alignof(BuffT));
+  }
+
+  static size_t calculateSize(uint16_t bufferSize, uint16_t maxLines)
+  {
+    return dataOffset(maxLines) + sizeof(BuffT) * bufferSize;
+  }
+
+  /// @brief Initialize the new segment, the other processes wait for the magic.
+  void initialize(uint16_t bufferSize, uint16_t maxLines)
+  {
+    _header->elementSize = sizeof(BuffT);
+    _header->bufferSize = bufferSize;
+    _header->maxLines = maxLines;
+    _header->linesOffset = linesOffset();
+    _header->dataOffset = dataOffset(maxLines);
+    _header->recoveries = 0;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&_header->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    new (&_header->state) BufferRingState();
+    BufferLineMarker *markers = reinterpret_cast<BufferLineMarker *>(reinterpret_cast<uint8_t *>(_header) + _header->linesOffset);
+    std::uninitialized_default_construct_n(markers, maxLines);
+
+    _header->magic.store(Magic, std::memory_order_release);
+  }
+
+  /// @brief Wait until the creator initializes the segment and check that it matches this process.
+  bool waitInitialized()
+  {
+    if (_mappedSize < sizeof(SharedBufferHeader))
+      return false;
+
+    for (int attempt = 0; _header->magic.load(std::memory_order_acquire) != Magic; attempt++)
+    {
+      if (attempt == 100)
+        return false;
+      usleep(1000);
+    }
+
+    return _header->elementSize == sizeof(BuffT) &&
+           _mappedSize >= calculateSize(_header->bufferSize, _header->maxLines);
+  }
+
+  bool lock()
+  {
+    int result = pthread_mutex_lock(&_header->mutex);
+    if (result == EOWNERDEAD)
+    {
+      // The owner died while holding the lock. A new marker is written before the positions are updated,
+      // but the owner may have died in the middle of any change, so the lines are checked one by one.
+      repairState();
+      _header->recoveries++;
+      pthread_mutex_consistent(&_header->mutex);
+      result = 0;
+    }
+    return result == 0;
+  }
+
+  void unlock()
+  {
+    pthread_mutex_unlock(&_header->mutex);
+  }
+
+  /// @brief Drop the lines from the first invalid marker to the last line: a marker with positions out of the buffer,
+  /// or an id that does not follow the id of the previous line (the readers find the lines by their ids).
+  void repairState()
+  {
+    BufferRingState &state = _header->state;
+    const BufferLineMarker *markers = reinterpret_cast<const BufferLineMarker *>(reinterpret_cast<uint8_t *>(_header) + _header->linesOffset);
+    bool firstValid = state.indexFirstLine >= 0 && state.indexFirstLine < _header->maxLines;
+    bool lastValid = state.indexLastLine >= 0 && state.indexLastLine < _header->maxLines;
+    int16_t last = -1;
+    if (firstValid && lastValid)
+    {
+      for (int16_t index = state.indexFirstLine;; index = (index + 1) % _header->maxLines)
+      {
+        const BufferLineMarker &line = markers[index];
+        if (line.startIndex < 0 || line.startIndex >= _header->bufferSize || line.endIndex < 0 ||
+            line.endIndex >= _header->bufferSize || (last >= 0 && line.id != markers[last].id + 1))
+          break;
+        last = index;
+        if (index == state.indexLastLine)
+          break;
+      }
+    }
+
+    if (last < 0)
+    {
+      state.indexFirstLine = -1;
+      state.indexLastLine = -1;
+    }
+    else
+    {
+      state.indexLastLine = last;
+      state.nextId = markers[last].id + 1;
+    }
+    // A change interrupted by the death of the owner leaves the generation odd, and DumpRaw would report
+    // every later dump as torn.
+    uint32_t generation = state.generation.load(std::memory_order_relaxed);
+    if ((generation & 1) != 0)
+      state.generation.store(generation + 1, std::memory_order_release);
+  }
+};
+
+#endif
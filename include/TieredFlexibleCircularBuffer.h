@@ -0,0 +1,239 @@
+#pragma once
+
+#ifndef TieredFlexibleCircularBuffer_h
+#define TieredFlexibleCircularBuffer_h
+
+#include "FlexibleCircularBuffer.h"
+
+#include <cstdio>
+#include <mutex>
+
+/// @brief Class of a line, used to decide what is kept in the cold tier.
+struct TierLineClass
+{
+public:
+  /// Severity of the line, the lines with at least TieredFlexibleCircularBuffer::SetMinSeverity are kept whole.
+  uint8_t severity = 0;
+  /// Tag of the line (source, subsystem), from 0 to TieredFlexibleCircularBuffer::MaxTags - 1.
+  uint8_t tag = 0;
+};
+
+/// @brief Two level buffer: the hot buffer keeps every line, and the lines evicted from it go to the cold buffer
+/// only if they are important (severity), sampled, or as a summary "N lines of tag X suppressed".
+/// So the recent history is detailed and the older history still exists in bounded memory.
+/// @tparam BuffT Type of the buffer.
+template <typename BuffT>
+class TieredFlexibleCircularBuffer : private FlexibleCircularBufferObserver<BuffT>
+{
+  static_assert(std::is_default_constructible<BuffT>::value, "The fragmented lines and the summaries are assembled in temporary arrays");
+
+public:
+  /// Count of tags with their own suppressed line counters.
+  static const uint8_t MaxTags = 16;
+
+  /// @brief Get the class of a line.
+  typedef TierLineClass (*LineClassifier)(const BufferLineView<BuffT> &line);
+
+  /// @brief Format the summary of the suppressed lines.
+  /// @return count of written elements, 0 to write no summary
+  typedef uint16_t (*SummaryFormatter)(uint8_t tag, uint32_t count, BuffT *to, uint16_t capacity);
+
+  /// @brief Constructor.
+  /// @param hotSize count of elements in the hot buffer
+  /// @param hotLines maximum count of lines in the hot buffer
+  /// @param coldSize count of elements in the cold buffer
+  /// @param coldLines maximum count of lines in the cold buffer
+  /// @param classifier class of a line, nullptr if all the lines have severity 0 and tag 0
+  TieredFlexibleCircularBuffer(uint16_t hotSize, uint16_t hotLines, uint16_t coldSize, uint16_t coldLines,
+                               LineClassifier classifier = nullptr)
+      : _hot(hotSize, hotLines),
+        _cold(coldSize, coldLines),
+        _classifier(classifier)
+  {
+    // The hot buffer is owned by this object, so its observer slots are all free.
+    _hot.AddObserver(this);
+  }
+
+  ~TieredFlexibleCircularBuffer()
+  {
+    _hot.RemoveObserver(this);
+  }
+
+  /// @brief Set the minimum severity of the lines that are kept whole in the cold buffer, 255 by default.
+  void SetMinSeverity(uint8_t severity)
+  {
+    _minSeverity = severity;
+  }
+
+  /// @brief Keep each N-th of the other lines in the cold buffer, 0 (none) by default.
+  void SetSampleEvery(uint16_t sampleEvery)
+  {
+    _sampleEvery = sampleEvery;
+  }
+
+  /// @brief Set the formatter of the summaries of the suppressed lines, nullptr for no summaries.
+  /// For text the summaries are written by default.
+  void SetSummaryFormatter(SummaryFormatter formatter)
+  {
+    _summaryFormatter = formatter;
+  }
+
+  /// @brief Write new line to the hot buffer
+  /// @param data data
+  /// @param length data length
+  /// @return id of the created line. 0 if error
+  uint32_t WriteLine(const BuffT *data, uint16_t length)
+  {
+    return _hot.WriteLine(data, length);
+  }
+
+  /// @brief Write the summaries of the lines suppressed since the last kept line to the cold buffer.
+  /// Otherwise they are written before the next kept line, which may never come.
+  void FlushSummaries()
+  {
+    std::lock_guard<std::mutex> lock(_coldMutex);
+    writeSummaries();
+  }
+
+  /// @brief Pass the lines of both buffers to the visitor in order of time: the cold lines, then the hot lines.
+  /// The pending summaries are written first (FlushSummaries), so the visitor sees every suppressed line counted.
+  /// @param visitor callable with (const BufferLineView<BuffT> &, bool cold), returns false to stop.
+  /// The ids of the cold lines are the ids of the cold buffer.
+  /// @return count of visited lines
+  template <typename Visitor>
+  uint32_t VisitTimeline(Visitor &&visitor)
+  {
+    FlushSummaries();
+    bool stopped = false;
+    uint32_t count = _cold.VisitLines(0, [&](const BufferLineView<BuffT> &line)
+                                      { return !(stopped = !visitor(line, true)); });
+    if (!stopped)
+      count += _hot.VisitLines(0, [&](const BufferLineView<BuffT> &line)
+                               { return visitor(line, false); });
+    return count;
+  }
+
+  /// @brief Get the buffer of the recent lines.
+  FlexibleCircularBuffer<BuffT> &GetHot()
+  {
+    return _hot;
+  }
+
+  /// @brief Get the buffer of the old lines.
+  FlexibleCircularBuffer<BuffT> &GetCold()
+  {
+    return _cold;
+  }
+
+private:
+  // Recent lines
+  FlexibleCircularBuffer<BuffT> _hot;
+  // Old lines
+  FlexibleCircularBuffer<BuffT> _cold;
+  // Class of a line
+  const LineClassifier _classifier;
+  // Minimum severity of the kept lines
+  uint8_t _minSeverity = 255;
+  // Keep each N-th of the other lines
+  uint16_t _sampleEvery = 0;
+  // Count of the other lines since the last sample
+  uint16_t _sampleCounter = 0;
+  // Formatter of the summaries
+  SummaryFormatter _summaryFormatter = defaultSummaryFormatter();
+  // Count of the suppressed lines of each tag, since the last kept line
+  uint32_t _suppressed[MaxTags] = {};
+  // Time of the first suppressed line since the last kept line
+  uint64_t _suppressedSince = 0;
+  // Guards the counters of the suppressed lines and keeps the summaries and the kept lines in order in the cold buffer
+  std::mutex _coldMutex;
+
+  /// Called by the hot buffer with its lock taken, the cold buffer has its own lock.
+  void OnLineEvicted(const BufferLineView<BuffT> &line) override
+  {
+    // An expired or superseded line was already dropped for the readers, it is neither kept nor counted.
+    if (line.stale)
+      return;
+
+    TierLineClass lineClass;
+    if (_classifier != nullptr)
+      lineClass = _classifier(line);
+    if (lineClass.tag >= MaxTags)
+      lineClass.tag = MaxTags - 1;
+
+    std::lock_guard<std::mutex> lock(_coldMutex);
+    bool keep = lineClass.severity >= _minSeverity;
+    if (!keep && _sampleEvery > 0 && ++_sampleCounter >= _sampleEvery)
+    {
+      _sampleCounter = 0;
+      keep = true;
+    }
+
+    if (!keep)
+    {
+      if (_suppressedSince == 0)
+        _suppressedSince = line.timestamp;
+      _suppressed[lineClass.tag]++;
+      return;
+    }
+
+    // The summary goes before the kept line, so the cold buffer stays in order of time.
+    writeSummaries();
+    moveToCold(line);
+  }
+
+  void moveToCold(const BufferLineView<BuffT> &line)
+  {
+    LineWriteOptions options;
+    options.timestamp = line.timestamp;
+    options.repeatCount = line.repeatCount;
+    // The ttl counts from the timestamp, so the line expires in the cold buffer when it would have in the hot one.
+    options.ttl = line.ttl;
+    options.key = line.key;
+
+    if (line.second == nullptr)
+    {
+      _cold.WriteLine(line.first, line.firstLength, options);
+      return;
+    }
+
+    // A fragmented line is joined before it is written.
+    BuffT *data = new BuffT[line.GetLength()];
+    line.CopyTo(data, 0, line.GetLength());
+    _cold.WriteLine(data, line.GetLength(), options);
+    delete[] data;
+  }
+
+  void writeSummaries()
+  {
+    if (_summaryFormatter == nullptr)
+      return;
+
+    LineWriteOptions options;
+    options.timestamp = _suppressedSince;
+    _suppressedSince = 0;
+
+    BuffT summary[64];
+    for (uint8_t tag = 0; tag < MaxTags; tag++)
+    {
+      if (_suppressed[tag] == 0)
+        continue;
+      uint16_t length = _summaryFormatter(tag, _suppressed[tag], summary, 64);
+      if (length > 0)
+        _cold.WriteLine(summary, length, options);
+      _suppressed[tag] = 0;
+    }
+  }
+
+  static SummaryFormatter defaultSummaryFormatter()
+  {
+    if constexpr (std::is_same<BuffT, char>::value)
+      return [](uint8_t tag, uint32_t count, char *to, uint16_t capacity) -> uint16_t
+      {
+        int length = snprintf(to, capacity, "%lu lines of tag %u suppressed", (unsigned long)count, tag);
+        return length < 0 || length >= capacity ? 0 : length + 1;
+      };
+    return nullptr;
+  }
+};
+
+#endif
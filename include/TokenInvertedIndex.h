@@ -0,0 +1,295 @@
+#pragma once
+
+#ifndef TokenInvertedIndex_h
+#define TokenInvertedIndex_h
+
+#include "FlexibleCircularBuffer.h"
+#include "FlexibleCircularBufferTokens.h"
+
+#include <algorithm>
+#include <vector>
+
+#if ThreadSafe == FreeRTOS
+#include <freertos/semphr.h>
+#else
+#include <mutex>
+#endif
+
+/// @brief Inverted index of the tokens of a text buffer: the hash of each token maps to the ids of the lines that contain it,
+/// so a lookup takes time proportional to the count of matches instead of a scan of the buffer.
+/// The postings are kept in a FIFO pool of a fixed size: the postings of the evicted lines are freed first,
+/// and if the pool is still full, the oldest postings are dropped (see GetCoveredFromId).
+/// A line changed by UpdateLine gets postings for its new tokens; the postings of the tokens it lost are kept,
+/// and VisitMatching skips the line for them.
+class TokenInvertedIndex : private FlexibleCircularBufferObserver<char>
+{
+public:
+  /// @brief Constructor, the index is attached to the buffer until it is destroyed.
+  /// Only the lines written after the constructor are indexed.
+  /// @param buffer the buffer
+  /// @param memoryLimit maximum size of the index in bytes
+  TokenInvertedIndex(FlexibleCircularBuffer<char> &buffer, size_t memoryLimit = 16384)
+      : _buffer(buffer)
+  {
+    // A quarter of the memory for the buckets, the rest for the postings.
+    size_t bucketCount = 1;
+    while (bucketCount * 2 * sizeof(uint64_t) <= memoryLimit / 4)
+      bucketCount *= 2;
+    _buckets.assign(bucketCount, NoPosting);
+    _postings.resize(std::max<size_t>(1, (memoryLimit - bucketCount * sizeof(uint64_t)) / sizeof(Posting)));
+
+#if ThreadSafe == FreeRTOS
+    _mutex = xSemaphoreCreateMutex();
+#endif
+    _attached = _buffer.AddObserver(this);
+  }
+
+  ~TokenInvertedIndex()
+  {
+    _buffer.RemoveObserver(this);
+#if ThreadSafe == FreeRTOS
+    vSemaphoreDelete(_mutex);
+#endif
+  }
+
+  TokenInvertedIndex(const TokenInvertedIndex &) = delete;
+  TokenInvertedIndex &operator=(const TokenInvertedIndex &) = delete;
+
+  /// @brief Check if the index observes the buffer. It does not if the buffer had FlexibleCircularBuffer::MaxObservers
+  /// observers already, then no line is indexed.
+  bool IsAttached() const
+  {
+    return _attached;
+  }
+
+  /// @brief Pass the ids of the lines that may contain the token to the function, from the newest posting:
+  /// from the newest line, except the lines changed by UpdateLine, which come in the order of their updates.
+  /// Different tokens can have the same hash, so a line may not contain the token (see VisitMatching).
+  /// @param token the token, a run of letters, digits and '_'
+  /// @param length length of the token
+  /// @param function callable with (uint32_t id), returns false to stop
+  /// @return count of passed ids
+  template <typename Function>
+  uint32_t FindIds(const char *token, uint16_t length, Function &&function)
+  {
+    uint32_t hash = FlexibleCircularBufferTokenHash(token, length);
+    uint32_t count = 0;
+    uint32_t lastId = 0;
+
+    lock();
+    for (uint64_t seq = _buckets[hash & (_buckets.size() - 1)]; isLive(seq);)
+    {
+      const Posting &posting = _postings[seq % _postings.size()];
+      seq = posting.next;
+      // The postings of an updated line can be newer than the postings of later lines, so an evicted line
+      // does not end the chain.
+      if ((int32_t)(posting.lineId - _firstLiveId) < 0)
+        continue;
+      if (posting.hash == hash && (count == 0 || posting.lineId != lastId))
+      {
+        count++;
+        lastId = posting.lineId;
+        if (!function(posting.lineId))
+          break;
+      }
+    }
+    unlock();
+    return count;
+  }
+
+  /// @brief Pass the lines that contain the token to the visitor, in order of ids.
+  /// @param token the token, a run of letters, digits and '_'
+  /// @param length length of the token
+  /// @param visitor callable with (const BufferLineView<char> &), returns false to stop
+  /// @return count of visited lines
+  template <typename Visitor>
+  uint32_t VisitMatching(const char *token, uint16_t length, Visitor &&visitor)
+  {
+    // The ids are collected first, so the buffer is not locked while the index is.
+    std::vector<uint32_t> ids;
+    FindIds(token, length, [&](uint32_t id)
+            { ids.push_back(id);
+              return true; });
+    std::sort(ids.begin(), ids.end(), [](uint32_t a, uint32_t b)
+              { return (int32_t)(a - b) < 0; });
+
+    uint32_t count = 0;
+    bool stopped = false;
+    for (auto id = ids.begin(); id != ids.end() && !stopped; ++id)
+      _buffer.VisitLine(*id, [&](const BufferLineView<char> &line)
+                        {
+                          if (!containsToken(line, token, length))
+                            return;
+                          count++;
+                          stopped = !visitor(line); });
+    return count;
+  }
+
+  /// @brief Get the id of the oldest line whose tokens are all in the index.
+  /// The older lines were in the index when the pool was full, their postings may be dropped.
+  uint32_t GetCoveredFromId()
+  {
+    lock();
+    uint32_t ret = _coveredFromId;
+    unlock();
+    return ret;
+  }
+
+private:
+  /// Line of a token, linked to the previous line of the same bucket.
+  struct Posting
+  {
+    // Hash of the token
+    uint32_t hash;
+    // Id of the line
+    uint32_t lineId;
+    // Sequence number of the previous posting of the bucket, NoPosting if none
+    uint64_t next;
+  };
+
+  static constexpr uint64_t NoPosting = UINT64_MAX;
+
+  // The indexed buffer
+  FlexibleCircularBuffer<char> &_buffer;
+  // Set if the index got an observer slot of the buffer
+  bool _attached = false;
+  // Sequence number of the newest posting of each bucket
+  std::vector<uint64_t> _buckets;
+  // FIFO pool of the postings, the posting with sequence number n is at n % size
+  std::vector<Posting> _postings;
+  // Sequence number of the oldest posting in the pool
+  uint64_t _tailSeq = 0;
+  // Sequence number of the next posting
+  uint64_t _headSeq = 0;
+  // Id of the oldest line in the buffer
+  uint32_t _firstLiveId = 0;
+  // Id of the oldest line with all its postings in the pool
+  uint32_t _coveredFromId = 0;
+
+#if ThreadSafe == FreeRTOS
+  SemaphoreHandle_t _mutex = nullptr;
+#else
+  std::mutex _mutex;
+#endif
+
+  void lock()
+  {
+#if ThreadSafe == FreeRTOS
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+#else
+    _mutex.lock();
+#endif
+  }
+
+  void unlock()
+  {
+#if ThreadSafe == FreeRTOS
+    xSemaphoreGive(_mutex);
+#else
+    _mutex.unlock();
+#endif
+  }
+
+  bool isLive(uint64_t seq) const
+  {
+    return seq != NoPosting && seq >= _tailSeq;
+  }
+
+  /// Add the posting of a token to the pool and make it the head of its bucket.
+  void addPosting(uint64_t &head, uint32_t hash, uint32_t lineId)
+  {
+    if (_headSeq - _tailSeq == _postings.size())
+    {
+      // The pool is full, the oldest posting of a live line is dropped.
+      // An updated line can have postings older than the covered lines, they do not move the covered id back.
+      uint32_t droppedId = _postings[_tailSeq % _postings.size()].lineId;
+      if ((int32_t)(droppedId + 1 - _coveredFromId) > 0)
+        _coveredFromId = droppedId + 1;
+      _tailSeq++;
+    }
+    _postings[_headSeq % _postings.size()] = {hash, lineId, isLive(head) ? head : NoPosting};
+    head = _headSeq++;
+  }
+
+  static bool containsToken(const BufferLineView<char> &line, const char *token, uint16_t length)
+  {
+    bool found = false;
+    FlexibleCircularBufferForEachToken(line, [&](uint32_t, uint16_t offset, uint16_t tokenLength)
+                                       {
+                                         if (found || tokenLength != length)
+                                           return;
+                                         uint16_t i = 0;
+                                         while (i < length && line[offset + i] == token[i])
+                                           i++;
+                                         found = i == length; });
+    return found;
+  }
+
+  /// Called by the buffer with its lock taken, after a line was written or data was added to the last line.
+  void OnLineWritten(const BufferLineView<char> &line) override
+  {
+    // The ids of the pinned lines are positions in the pinned region, not ids of the buffer.
+    if (line.pinned)
+      return;
+    lock();
+    if (_headSeq == 0)
+      _firstLiveId = _coveredFromId = line.id;
+
+    FlexibleCircularBufferForEachToken(line, [&](uint32_t hash, uint16_t, uint16_t)
+                                       {
+                                         uint64_t &head = _buckets[hash & (_buckets.size() - 1)];
+                                         // A token repeated in the line, or seen again after WriteToLastLine.
+                                         if (isLive(head))
+                                         {
+                                           const Posting &newest = _postings[head % _postings.size()];
+                                           if (newest.hash == hash && newest.lineId == line.id)
+                                             return;
+                                         }
+
+                                         addPosting(head, hash, line.id); });
+    unlock();
+  }
+
+  /// Called by the buffer with its lock taken, after the data of a line was replaced by UpdateLine.
+  void OnLineUpdated(const BufferLineView<char> &line) override
+  {
+    lock();
+    if ((int32_t)(line.id - _coveredFromId) < 0)
+    {
+      // The line is older than the covered lines, its postings may be dropped already.
+      unlock();
+      return;
+    }
+
+    FlexibleCircularBufferForEachToken(line, [&](uint32_t hash, uint16_t, uint16_t)
+                                       {
+                                         uint64_t &head = _buckets[hash & (_buckets.size() - 1)];
+                                         // The postings of the line are not in order with the others, so the whole chain
+                                         // is searched for a token that the line had before.
+                                         for (uint64_t seq = head; isLive(seq);)
+                                         {
+                                           const Posting &posting = _postings[seq % _postings.size()];
+                                           if (posting.hash == hash && posting.lineId == line.id)
+                                             return;
+                                           seq = posting.next;
+                                         }
+                                         addPosting(head, hash, line.id); });
+    unlock();
+  }
+
+  /// Called by the buffer with its lock taken, before the oldest line is overwritten.
+  void OnLineEvicted(const BufferLineView<char> &line) override
+  {
+    lock();
+    _firstLiveId = line.id + 1;
+    if ((int32_t)(_coveredFromId - _firstLiveId) < 0)
+      _coveredFromId = _firstLiveId;
+    // The postings are in order of lines, except the postings of the updated lines, so the postings of the evicted line
+    // are the oldest ones; the postings of an updated line that stay in the pool are skipped by FindIds.
+    while (_tailSeq < _headSeq && (int32_t)(_postings[_tailSeq % _postings.size()].lineId - _firstLiveId) < 0)
+      _tailSeq++;
+    unlock();
+  }
+};
+
+#endif
@@ -0,0 +1,124 @@
+#pragma once
+
+#ifndef TypedRecordBuffer_h
+#define TypedRecordBuffer_h
+
+#include "FlexibleCircularBuffer.h"
+
+/// @brief Combine several lambdas into one visitor: TypedRecordBuffer::Visit(id, Overloaded{[](const A &) {}, [](const B &) {}})
+template <typename... Handlers>
+struct Overloaded : Handlers...
+{
+  using Handlers::operator()...;
+};
+
+template <typename... Handlers>
+Overloaded(Handlers...) -> Overloaded<Handlers...>;
+
+/// @brief Circular buffer for records of different types, all of them share one memory pool and one order.
+/// Each line holds one byte with the type id (the position of the type in Types) followed by the record.
+/// @tparam Types Types of the records, must be trivially copyable.
+template <typename... Types>
+class TypedRecordBuffer
+{
+  static_assert(sizeof...(Types) > 0 && sizeof...(Types) <= 255, "TypedRecordBuffer supports from 1 to 255 record types");
+  static_assert((std::is_trivially_copyable<Types>::value && ...), "Record types must be trivially copyable");
+
+public:
+  TypedRecordBuffer(uint16_t bufferSize = 4096, uint16_t maxLines = 128)
+      : _buffer(bufferSize, maxLines)
+  {
+  }
+
+  /// @brief Get the type id of the record type.
+  template <typename T>
+  static constexpr uint8_t TypeId()
+  {
+    constexpr bool matches[] = {std::is_same<T, Types>::value...};
+    for (uint8_t i = 0; i < sizeof...(Types); i++)
+      if (matches[i])
+        return i;
+    return 255;
+  }
+
+  /// @brief Write a record to the buffer.
+  /// @param record record
+  /// @return id of the created line. 0 if error
+  template <typename T>
+  uint32_t Write(const T &record)
+  {
+    static_assert(TypeId<T>() != 255, "T is not one of the record types of this buffer");
+
+    uint8_t line[1 + sizeof(T)];
+    line[0] = TypeId<T>();
+    memcpy(line + 1, &record, sizeof(T));
+    return _buffer.WriteLine(line, sizeof(line));
+  }
+
+  /// @brief Pass the record with given id to the handler, the overload is selected by the stored type id.
+  /// The record is not copied out of the buffer to the heap, it is read to the stack, because the line
+  /// can be fragmented and is not aligned for T.
+  /// The buffer is locked while the handler runs, so the handler must not write to this buffer.
+  /// @param id id of the line
+  /// @param handler callable with (const T &) for every record type, see Overloaded
+  /// @return false if the line was not found or has an unknown type
+  template <typename Handler>
+  bool Visit(uint32_t id, Handler &&handler)
+  {
+    bool ret = false;
+    _buffer.VisitLine(id, [&](const BufferLineView<uint8_t> &line)
+                      { ret = dispatch(line, handler); });
+    return ret;
+  }
+
+  /// @brief Pass the records to the handler in order, starting from the line with given id.
+  /// @param fromId id of the first line to visit
+  /// @param handler callable with (const T &) for every record type, see Overloaded
+  /// @return count of visited lines
+  template <typename Handler>
+  uint16_t VisitAll(uint32_t fromId, Handler &&handler)
+  {
+    return _buffer.VisitLines(fromId, [&](const BufferLineView<uint8_t> &line)
+                              {
+                                dispatch(line, handler);
+                                return true; });
+  }
+
+  /// @brief Get the buffer with the encoded records.
+  FlexibleCircularBuffer<uint8_t> &GetBuffer()
+  {
+    return _buffer;
+  }
+
+private:
+  FlexibleCircularBuffer<uint8_t> _buffer;
+
+  template <typename Handler>
+  static bool dispatch(const BufferLineView<uint8_t> &line, Handler &handler)
+  {
+    if (line.GetLength() == 0)
+      return false;
+    return dispatch(line, handler, std::index_sequence_for<Types...>());
+  }
+
+  template <typename Handler, size_t... TypeIds>
+  static bool dispatch(const BufferLineView<uint8_t> &line, Handler &handler, std::index_sequence<TypeIds...>)
+  {
+    uint8_t typeId = line[0];
+    return ((typeId == TypeIds && invoke<Types>(line, handler)) || ...);
+  }
+
+  template <typename T, typename Handler>
+  static bool invoke(const BufferLineView<uint8_t> &line, Handler &handler)
+  {
+    if (line.GetLength() != 1 + sizeof(T))
+      return false;
+
+    alignas(T) uint8_t record[sizeof(T)];
+    line.CopyTo(record, 1, sizeof(T));
+    handler(*std::launder(reinterpret_cast<const T *>(record)));
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,88 @@
+#pragma once
+
+#ifndef TestHelpers_h
+#define TestHelpers_h
+
+#include "FlexibleCircularBuffer.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// Fails the test with the location of the check. Unlike assert, it is kept when NDEBUG is defined.
+#define CHECK(condition)                                                           \
+  do                                                                               \
+  {                                                                                \
+    if (!(condition))                                                              \
+    {                                                                              \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      exit(1);                                                                     \
+    }                                                                              \
+  } while (0)
+
+/// @brief Write the text with its \0 as a new line.
+inline uint32_t writeText(FlexibleCircularBuffer<char> &buffer, const char *text,
+                          const LineWriteOptions &options = LineWriteOptions())
+{
+  return buffer.WriteLine(text, strlen(text) + 1, options);
+}
+
+/// @brief Get the text of a line, without its \0.
+inline std::string textOf(const BufferLineView<char> &line)
+{
+  std::string text(line.GetLength(), '\0');
+  line.CopyTo(&text[0], 0, line.GetLength());
+  return text.c_str();
+}
+
+/// @brief Get the text of the line with the given id, empty if the line is not visible.
+inline std::string readText(FlexibleCircularBuffer<char> &buffer, uint32_t id)
+{
+  std::string text;
+  buffer.VisitLine(id, [&](const BufferLineView<char> &line)
+                   { text = textOf(line); });
+  return text;
+}
+
+/// @brief Get the texts of the visible lines, separated by commas.
+inline std::string readAll(FlexibleCircularBuffer<char> &buffer)
+{
+  std::string texts;
+  buffer.VisitLines(0, [&](const BufferLineView<char> &line)
+                    {
+                      texts += (texts.empty() ? "" : ",") + textOf(line);
+                      return true; });
+  return texts;
+}
+
+/// @brief Counts the notifications of the buffer.
+class CountingObserver : public FlexibleCircularBufferObserver<char>
+{
+public:
+  uint32_t written = 0;
+  uint32_t updated = 0;
+  uint32_t evicted = 0;
+  uint32_t evictedStale = 0;
+  uint32_t lastRepeatCount = 0;
+
+  void OnLineWritten(const BufferLineView<char> &) override
+  {
+    written++;
+  }
+
+  void OnLineUpdated(const BufferLineView<char> &line) override
+  {
+    updated++;
+    lastRepeatCount = line.repeatCount;
+  }
+
+  void OnLineEvicted(const BufferLineView<char> &line) override
+  {
+    evicted++;
+    if (line.stale)
+      evictedStale++;
+  }
+};
+
+#endif
@@ -0,0 +1,150 @@
+// Named consumers (AddConsumer), holds (HoldLines) and the drainer committing a consumer.
+#include "TestHelpers.h"
+#include "FlexibleCircularBufferDrainer.h"
+
+#include <atomic>
+#include <thread>
+
+static void testReject()
+{
+  FlexibleCircularBuffer<char> buffer(256, 4);
+  CHECK(buffer.AddConsumer("reader", ConsumerPolicy::Reject));
+  CHECK(!buffer.AddConsumer("a name that is too long"));
+
+  for (int i = 1; i <= 4; i++)
+    CHECK(writeText(buffer, std::to_string(i).c_str()) == (uint32_t)i);
+  // The first line was not committed, it is not overwritten.
+  CHECK(writeText(buffer, "5") == 0);
+  CHECK(readAll(buffer) == "1,2,3,4");
+
+  CHECK(buffer.CommitConsumer("reader", 2));
+  CHECK(writeText(buffer, "5") == 5);
+  CHECK(writeText(buffer, "6") == 6);
+  CHECK(writeText(buffer, "7") == 0);
+
+  // An older id is ignored, and adding the consumer again keeps its position.
+  CHECK(buffer.CommitConsumer("reader", 1));
+  CHECK(buffer.AddConsumer("reader", ConsumerPolicy::Reject));
+  uint32_t committedId = 0;
+  CHECK(buffer.GetConsumerOffset("reader", committedId) && committedId == 2);
+  CHECK(!buffer.CommitConsumer("unknown", 6));
+
+  buffer.RemoveConsumer("reader");
+  CHECK(!buffer.GetConsumerOffset("reader", committedId));
+  CHECK(writeText(buffer, "7") == 7);
+}
+
+static void testEvict()
+{
+  FlexibleCircularBuffer<char> buffer(256, 4);
+  CHECK(buffer.AddConsumer("reader", ConsumerPolicy::Evict));
+  for (int i = 1; i <= 6; i++)
+    CHECK(writeText(buffer, std::to_string(i).c_str()) != 0);
+  CHECK(buffer.GetConsumerLosses("reader") == 2);
+
+  CHECK(buffer.CommitConsumer("reader", 6));
+  writeText(buffer, "7");
+  CHECK(buffer.GetConsumerLosses("reader") == 2);
+}
+
+static void testBlock()
+{
+  FlexibleCircularBuffer<char> buffer(256, 4);
+  CHECK(buffer.AddConsumer("reader", ConsumerPolicy::Block));
+  for (int i = 1; i <= 4; i++)
+    writeText(buffer, std::to_string(i).c_str());
+
+  std::atomic<bool> written{false};
+  std::thread writer([&]
+                     {
+                       CHECK(writeText(buffer, "5") == 5);
+                       written = true; });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  CHECK(!written);
+  CHECK(buffer.CommitConsumer("reader", 1));
+  writer.join();
+  CHECK(readAll(buffer) == "2,3,4,5");
+}
+
+static void testHolds()
+{
+  FlexibleCircularBuffer<char> buffer(256, 4);
+  int first, second;
+  for (int i = 1; i <= 4; i++)
+    writeText(buffer, std::to_string(i).c_str());
+
+  // Each owner has its own hold.
+  CHECK(buffer.HoldLines(1, &first));
+  CHECK(buffer.HoldLines(3, &second));
+  CHECK(writeText(buffer, "5") == 0);
+  CHECK(buffer.GetRejectedWrites() == 1);
+
+  buffer.ReleaseLines(&first);
+  CHECK(writeText(buffer, "5") == 5);
+  CHECK(writeText(buffer, "6") == 6);
+  CHECK(writeText(buffer, "7") == 0);
+
+  // A new call of the same owner moves its hold.
+  CHECK(buffer.HoldLines(5, &second));
+  CHECK(writeText(buffer, "7") == 7);
+  buffer.ReleaseLines(&second);
+}
+
+// Fails the first writes, then collects the drained text.
+struct FlakySink
+{
+  int failures = 3;
+  std::string drained;
+
+  static bool write(void *context, const char *data, size_t length)
+  {
+    FlakySink *sink = static_cast<FlakySink *>(context);
+    if (sink->failures > 0)
+    {
+      sink->failures--;
+      return false;
+    }
+    sink->drained.append(data, length);
+    return true;
+  }
+};
+
+static void testDrainerRetries()
+{
+  FlexibleCircularBuffer<char> buffer(256, 16);
+  FlakySink flaky;
+  CallbackSink<char> sink(FlakySink::write, &flaky);
+  FlexibleCircularBufferDrainer<char> drainer(buffer, sink, 32, 10);
+  CHECK(drainer.SetConsumer("drainer", ConsumerPolicy::Reject));
+  CHECK(drainer.Start());
+
+  std::string expected;
+  for (int i = 0; i < 10; i++)
+  {
+    writeText(buffer, "line");
+    expected.append("line", 5);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  drainer.Flush();
+
+  // The failed batches are written again, and committed only then.
+  DrainerMetrics metrics = drainer.GetMetrics();
+  CHECK(metrics.sinkErrors == 3);
+  CHECK(metrics.linesDrained == 10 && metrics.linesLost == 0);
+  CHECK(flaky.drained == expected);
+  uint32_t committedId = 0;
+  CHECK(buffer.GetConsumerOffset("drainer", committedId) && committedId == 10);
+  drainer.Stop();
+}
+
+int main()
+{
+  testReject();
+  testEvict();
+  testBlock();
+  testHolds();
+  testDrainerRetries();
+  printf("consumer tests passed\n");
+  return 0;
+}
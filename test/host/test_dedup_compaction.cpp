@@ -0,0 +1,81 @@
+// Suppression of duplicate lines (SetDeduplicate) and compaction by keys (SetCompaction).
+#include "TestHelpers.h"
+
+static void testDeduplicate()
+{
+  FlexibleCircularBuffer<char> buffer(256, 8);
+  CountingObserver observer;
+  buffer.AddObserver(&observer);
+  buffer.SetDeduplicate(true);
+
+  uint32_t id = writeText(buffer, "storm");
+  CHECK(writeText(buffer, "storm") == id);
+  CHECK(writeText(buffer, "storm") == id);
+  CHECK(observer.written == 1 && observer.updated == 2 && observer.lastRepeatCount == 2);
+
+  uint32_t repeatCount = 0;
+  buffer.VisitLine(id, [&](const BufferLineView<char> &line)
+                   { repeatCount = line.repeatCount; });
+  CHECK(repeatCount == 2);
+
+  // The same data with another key, ttl or source is a new line.
+  LineWriteOptions options;
+  options.key = 5;
+  CHECK(writeText(buffer, "storm", options) == id + 1);
+  options = LineWriteOptions();
+  options.sourceId = 2;
+  CHECK(writeText(buffer, "storm", options) == id + 2);
+  options = LineWriteOptions();
+  options.ttl = 1000;
+  CHECK(writeText(buffer, "storm", options) == id + 3);
+
+  // Only the last line is compared.
+  CHECK(writeText(buffer, "other") == id + 4);
+  CHECK(writeText(buffer, "storm") == id + 5);
+
+  buffer.SetDeduplicate(false);
+  CHECK(writeText(buffer, "storm") == id + 6);
+  buffer.RemoveObserver(&observer);
+}
+
+static void testCompaction()
+{
+  FlexibleCircularBuffer<char> buffer(256, 8);
+  LineWriteOptions key1, key2;
+  key1.key = 1;
+  key2.key = 2;
+
+  // The lines written before the compaction is enabled are indexed too.
+  writeText(buffer, "state 1 v1", key1);
+  buffer.SetCompaction(true);
+  writeText(buffer, "state 2 v1", key2);
+  writeText(buffer, "plain");
+  uint32_t latestId = writeText(buffer, "state 1 v2", key1);
+
+  std::string latest;
+  CHECK(buffer.VisitLatest(1, [&](const BufferLineView<char> &line)
+                           { latest = textOf(line); }));
+  CHECK(latest == "state 1 v2");
+  CHECK(!buffer.VisitLatest(3, [](const BufferLineView<char> &) {}));
+
+  // The superseded line is skipped by the readers, but stays in the id range until it is evicted.
+  CHECK(readAll(buffer) == "state 2 v1,plain,state 1 v2");
+  uint32_t firstId, lastId;
+  CHECK(buffer.GetIdRange(firstId, lastId) && firstId == 1 && lastId == latestId);
+
+  // The latest line of a key is evicted like any other line.
+  for (int i = 0; i < 8; i++)
+    writeText(buffer, "filler");
+  CHECK(!buffer.VisitLatest(1, [](const BufferLineView<char> &) {}));
+
+  buffer.SetCompaction(false);
+  CHECK(!buffer.VisitLatest(1, [](const BufferLineView<char> &) {}));
+}
+
+int main()
+{
+  testDeduplicate();
+  testCompaction();
+  printf("dedup and compaction tests passed\n");
+  return 0;
+}
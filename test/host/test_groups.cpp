@@ -0,0 +1,79 @@
+// Groups of lines (BeginGroup, CommitGroup).
+#include "TestHelpers.h"
+
+#include <atomic>
+#include <thread>
+
+static void testVisibility()
+{
+  FlexibleCircularBuffer<char> buffer(256, 16);
+  CountingObserver observer;
+  buffer.AddObserver(&observer);
+  writeText(buffer, "before");
+
+  CHECK(!buffer.CommitGroup());
+  CHECK(buffer.BeginGroup());
+  CHECK(!buffer.BeginGroup());
+  uint32_t headerId = writeText(buffer, "header");
+  writeText(buffer, "row 1");
+  writeText(buffer, "row 2");
+
+  // The lines of the group are hidden from the readers and the observers until the commit.
+  uint32_t firstId, lastId;
+  CHECK(buffer.GetIdRange(firstId, lastId) && lastId == headerId - 1);
+  CHECK(readText(buffer, headerId).empty());
+  CHECK(readAll(buffer) == "before");
+  CHECK(observer.written == 1);
+
+  CHECK(buffer.CommitGroup());
+  CHECK(readAll(buffer) == "before,header,row 1,row 2");
+  CHECK(observer.written == 4);
+  CHECK(!buffer.CommitGroup());
+  buffer.RemoveObserver(&observer);
+}
+
+static void testOtherWriterWaits()
+{
+  FlexibleCircularBuffer<char> buffer(256, 16);
+  CHECK(buffer.BeginGroup());
+  writeText(buffer, "header");
+
+  std::atomic<bool> written{false};
+  std::thread other([&]
+                    {
+                      writeText(buffer, "other");
+                      written = true; });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  CHECK(!written);
+  writeText(buffer, "row");
+  CHECK(buffer.CommitGroup());
+  other.join();
+
+  // The lines of the group stay consecutive.
+  CHECK(readAll(buffer) == "header,row,other");
+}
+
+static void testGroupMustFit()
+{
+  FlexibleCircularBuffer<char> buffer(32, 16);
+  CHECK(buffer.BeginGroup());
+  uint32_t headerId = writeText(buffer, "header-");
+  CHECK(headerId != 0);
+  CHECK(writeText(buffer, "row-1--") != 0);
+  CHECK(writeText(buffer, "row-2--") != 0);
+  CHECK(writeText(buffer, "row-3--") != 0);
+  // This line would overwrite the header of its own group.
+  CHECK(writeText(buffer, "row-4--") == 0);
+  CHECK(buffer.CommitGroup());
+  CHECK(readText(buffer, headerId) == "header-");
+}
+
+int main()
+{
+  testVisibility();
+  testOtherWriterWaits();
+  testGroupMustFit();
+  printf("group tests passed\n");
+  return 0;
+}
@@ -0,0 +1,148 @@
+// Wrap around, eviction, lifetime of the lines (ttl) and elements that are not trivially copyable.
+#include "TestHelpers.h"
+
+#include <thread>
+
+// Element that counts its live instances.
+struct Counted
+{
+  static int live;
+  int value = 0;
+
+  Counted()
+  {
+    live++;
+  }
+  Counted(int value) : value(value)
+  {
+    live++;
+  }
+  Counted(const Counted &other) : value(other.value)
+  {
+    live++;
+  }
+  Counted &operator=(const Counted &other) = default;
+  ~Counted()
+  {
+    live--;
+  }
+};
+
+int Counted::live = 0;
+
+static void testIds()
+{
+  FlexibleCircularBuffer<char> buffer(64, 8);
+  uint32_t firstId, lastId;
+  CHECK(!buffer.GetIdRange(firstId, lastId));
+
+  CHECK(writeText(buffer, "one") == 1);
+  CHECK(writeText(buffer, "two") == 2);
+  CHECK(buffer.GetIdRange(firstId, lastId) && firstId == 1 && lastId == 2);
+  CHECK(readText(buffer, 2) == "two");
+
+  // A line must fit in half of the buffer, an empty line is an error.
+  char longLine[33] = {};
+  CHECK(buffer.WriteLine(longLine, sizeof(longLine)) == 0);
+  CHECK(buffer.WriteLine("", 0) == 0);
+}
+
+static void testEvictionByLines()
+{
+  FlexibleCircularBuffer<char> buffer(256, 4);
+  CountingObserver observer;
+  buffer.AddObserver(&observer);
+
+  for (int i = 1; i <= 10; i++)
+    CHECK(writeText(buffer, std::to_string(i).c_str()) == (uint32_t)i);
+
+  uint32_t firstId, lastId;
+  CHECK(buffer.GetIdRange(firstId, lastId) && firstId == 7 && lastId == 10);
+  CHECK(readAll(buffer) == "7,8,9,10");
+  CHECK(readText(buffer, 6).empty());
+  CHECK(observer.written == 10 && observer.evicted == 6);
+  buffer.RemoveObserver(&observer);
+}
+
+static void testEvictionByCells()
+{
+  FlexibleCircularBuffer<char> buffer(32, 16);
+  bool fragmented = false;
+  for (int i = 0; i < 40; i++)
+  {
+    char text[10];
+    snprintf(text, sizeof(text), "line-%03d", i);
+    uint32_t id = writeText(buffer, text);
+    CHECK(id == (uint32_t)i + 1);
+    // Every line is intact, also the ones that wrap around the end of the buffer.
+    CHECK(readText(buffer, id) == text);
+    buffer.VisitLine(id, [&](const BufferLineView<char> &line)
+                     { fragmented |= line.second != nullptr; });
+
+    // The oldest lines are evicted to make room, and the lines stay contiguous.
+    uint32_t firstId, lastId;
+    CHECK(buffer.GetIdRange(firstId, lastId) && lastId == id);
+    CHECK(lastId - firstId + 1 <= 32 / 9);
+    for (uint32_t older = firstId; older < lastId; older++)
+      CHECK(readText(buffer, older).size() == 8);
+  }
+  CHECK(fragmented);
+}
+
+static void testTtl()
+{
+  FlexibleCircularBuffer<char> buffer(256, 8);
+  CountingObserver observer;
+  buffer.AddObserver(&observer);
+
+  LineWriteOptions options;
+  options.ttl = 1;
+  writeText(buffer, "kept");
+  uint32_t expiringId = writeText(buffer, "expiring", options);
+  writeText(buffer, "also kept");
+  CHECK(readText(buffer, expiringId) == "expiring");
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  CHECK(readText(buffer, expiringId).empty());
+  CHECK(readAll(buffer) == "kept,also kept");
+
+  // The expired line is evicted as stale, not as a lost line.
+  for (int i = 0; i < 8; i++)
+    writeText(buffer, "next");
+  CHECK(observer.evictedStale == 1);
+  buffer.RemoveObserver(&observer);
+}
+
+static void testNonTrivialElements()
+{
+  {
+    FlexibleCircularBuffer<Counted> buffer(16, 8);
+    Counted data[5] = {1, 2, 3, 4, 5};
+    for (int i = 0; i < 20; i++)
+      CHECK(buffer.WriteLine(data, 3 + i % 3) != 0);
+
+    // Only the elements of the live lines exist.
+    int elements = 0;
+    buffer.VisitLines(0, [&](const BufferLineView<Counted> &line)
+                      {
+                        elements += line.GetLength();
+                        Counted copy[5];
+                        line.CopyTo(copy, 0, line.GetLength());
+                        for (uint16_t i = 0; i < line.GetLength(); i++)
+                          CHECK(copy[i].value == i + 1);
+                        return true; });
+    CHECK(Counted::live == 5 + elements);
+  }
+  CHECK(Counted::live == 0);
+}
+
+int main()
+{
+  testIds();
+  testEvictionByLines();
+  testEvictionByCells();
+  testTtl();
+  testNonTrivialElements();
+  printf("ring tests passed\n");
+  return 0;
+}
@@ -0,0 +1,79 @@
+// Buffer in shared memory (SharedFlexibleCircularBuffer) and its recovery from a process that died holding the lock.
+#include "TestHelpers.h"
+#include "SharedFlexibleCircularBuffer.h"
+
+#include <sys/wait.h>
+
+static void testAttach(const char *name)
+{
+  SharedFlexibleCircularBuffer<char> writer(name, 256, 8);
+  CHECK(writer.IsOpen());
+  CHECK(writer.WriteLine("first", 6) == 1);
+
+  // A second object attaches to the same lines, its own size arguments are ignored.
+  SharedFlexibleCircularBuffer<char> reader(name, 16, 2);
+  CHECK(reader.IsOpen());
+  CHECK(reader.WriteLine("second", 7) == 2);
+  std::string texts = writer.Access([](FlexibleCircularBuffer<char> &buffer)
+                                    { return readAll(buffer); });
+  CHECK(texts == "first,second");
+
+  // The state of a group and the waiting of a blocked writer are not shared.
+  CHECK(!writer.Access([](FlexibleCircularBuffer<char> &buffer)
+                       { return buffer.BeginGroup(); }));
+  CHECK(!writer.Access([](FlexibleCircularBuffer<char> &buffer)
+                       { return buffer.AddConsumer("blocking", ConsumerPolicy::Block); }));
+
+  // The consumers are shared with the lines.
+  CHECK(writer.Access([](FlexibleCircularBuffer<char> &buffer)
+                      { return buffer.AddConsumer("reader", ConsumerPolicy::Evict) && buffer.CommitConsumer("reader", 1); }));
+  uint32_t committedId = 0;
+  CHECK(reader.Access([&](FlexibleCircularBuffer<char> &buffer)
+                      { return buffer.GetConsumerOffset("reader", committedId); }));
+  CHECK(committedId == 1);
+}
+
+static void testRecovery(const char *name)
+{
+  SharedFlexibleCircularBuffer<char> buffer(name, 256, 8);
+  CHECK(buffer.IsOpen());
+  CHECK(buffer.WriteLine("before", 7) != 0);
+
+  pid_t child = fork();
+  CHECK(child >= 0);
+  if (child == 0)
+  {
+    // The child dies while it holds the lock.
+    SharedFlexibleCircularBuffer<char> dying(name);
+    dying.Access([](FlexibleCircularBuffer<char> &attached)
+                 {
+                   writeText(attached, "from child");
+                   _exit(0); });
+    _exit(1);
+  }
+  int status = 0;
+  CHECK(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  // The next process that takes the lock repairs the state and continues.
+  CHECK(buffer.WriteLine("after", 6) != 0);
+  CHECK(buffer.GetRecoveries() == 1);
+  std::string texts = buffer.Access([](FlexibleCircularBuffer<char> &attached)
+                                    { return readAll(attached); });
+  CHECK(texts == "first,second,before,from child,after");
+  CHECK(buffer.Access([](FlexibleCircularBuffer<char> &attached)
+                      { return attached.GetGeneration() % 2 == 0; }));
+}
+
+int main()
+{
+  char name[32];
+  snprintf(name, sizeof(name), "/fcb-host-test-%d", (int)getpid());
+  SharedFlexibleCircularBuffer<char>::Unlink(name);
+
+  testAttach(name);
+  testRecovery(name);
+
+  SharedFlexibleCircularBuffer<char>::Unlink(name);
+  printf("shared memory tests passed\n");
+  return 0;
+}